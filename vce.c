@@ -33,9 +33,37 @@
 #include <unistd.h>
 
 #ifdef __unix__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <signal.h>
+#endif
+
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <termios.h>
 
-#define BUF (8 * 1024 * 1024)
+#define BUF (8 * 1024 * 1024)	/* Initial size and default limit */
+#define BUF_GAP (64 * 1024)	/* Keep at least this much gap */
+#define BUF_GROW 20		/* Growth factor, in tenths */
+
+#define BACKLOG COL_MAX		/* Output queued before frames are dropped */
+#define FRAME_WAIT 20		/* ms between retries of a dropped frame */
+#define NOTE_WAIT 3000		/* ms a message stays up without a key */
+
+#define SNAP_BLOCK (64 * 1024)	/* Most bytes copied out of a snapshot at once */
+
+#define GREP_MAX 64		/* Most threads a walk or search runs */
+#define GREP_LINE 160		/* Longest line copied into the results */
+#define GREP_BLOCK (256 * 1024)	/* Bytes read from a file at once */
 #endif
 
 #ifdef __cpm__
@@ -65,6 +93,56 @@
 
 #define MFLAGS (O_CREAT | O_TRUNC | O_WRONLY)
 
+#define ISWORD(c) ((c) != ' ' && (unsigned char) ((c) - '\t') > 4)
+
+/*
+ * Bytes per hex row: "OOOOOOOO  hh hh ... a..."
+ */
+#define HEX_W (COL_MAX >= 75 ? 16 : COL_MAX >= 43 ? 8 : COL_MAX >= 27 ? 4 : 1)
+
+/*
+ * Columns of the opcode, operand and comment in a80 source.
+ */
+#ifndef A80_OP
+#define A80_OP 8
+#define A80_ARG 16
+#define A80_COM 32
+#endif
+
+#ifdef __unix__
+#define MARK_MAX 8192
+#define ROW_CACHE (ROW_MAX * 4)	/* Rows kept by the layout cache */
+#define HIST_MAX 32		/* Answers remembered per prompt */
+#define CURSOR_MAX 1024		/* Cursors besides the main one */
+#define DIR_CACHE 8		/* Directory listings kept for completion */
+#define UNDO_MAX 16384		/* Changes that can be undone */
+#define UNDO_PACK (64 * 1024)	/* Old text this long is kept packed */
+#define LZ_BLOCK (1024 * 1024)	/* Bytes packed at a time */
+#define LZ_HASH (1 << 14)	/* Slots in a packer's match table */
+#define COLD_CHUNK (256 * 1024)	/* Bytes packed and unpacked as one */
+#define COLD_MIN 16		/* Fewest chunks kept unpacked */
+#else
+#define MARK_MAX 32
+#define ROW_CACHE 4
+#define HIST_MAX 4
+#define CURSOR_MAX 8
+#define CLIP_MAX 1024		/* Bytes a cut rectangle may hold */
+#define UNDO_MAX 32
+#define UNDO_BYTES 1024		/* Old text kept for undo */
+#endif
+
+/*
+ * Prompts, each with its own history.
+ */
+#define PR_FILE 0
+#define PR_LINE 1
+#define PR_OFFSET 2
+#define PR_OPEN 3
+#define PR_FIND 4
+#define PR_GREP 5
+#define PR_FILL 6
+#define PR_MAX 7
+
 /*
  * vce - Visual Code Editor
  */
@@ -73,19 +151,64 @@ static char *buf, *ebuf;
 static char *gap, *egap;
 static char modeline[COL_MAX], screen[ROW_MAX - 1][COL_MAX];
 static char filename[COL_MAX - 5], response[COL_MAX - 5];
+static char note[COL_MAX - 5];
+
+static const char *prompts[PR_MAX] = {
+	"File: ", "Line: ", "Offset: ", "Open: ", "Find: ", "Grep: ",
+	"Fill: "
+};
+static char hist[PR_MAX][HIST_MAX][COL_MAX - 5];
+static int nhist[PR_MAX];
 
 static int col, row = 1, line = 1;
 static int idx, page, epage;
-static int dirty;
+static int dirty, results;
+static int hexmode, nibble;
+static int statmode;
+static int numbers, gutter;
+
+/*
+ * More places that typing goes in, in offset order.
+ */
+static int cursors[CURSOR_MAX], ncursors;
+
+/*
+ * Buffer statistics, kept up to date by the edit primitives.
+ * The version changes with every edit.
+ */
+static long nwords, nlf;
+static unsigned long version;
+
+/*
+ * The same counts over the region, valid while selversion is
+ * the version, for the bytes from sello up to selhi.
+ */
+static long sellf, selwords;
+static int sello, selhi, selok;
+static unsigned long selversion;
+
+/*
+ * Marks are kept in position order.  The tree holds the distance
+ * from each mark to the one before it, so a position is a prefix
+ * sum and an edit shifts every later mark with a single update.
+ */
+static int marktree[MARK_MAX + 1], nmarks;
+static char markname[MARK_MAX + 1];
+
+#ifdef __unix__
+static unsigned long bufsize = BUF, bufmax = BUF;
+static unsigned long bufgap = BUF_GAP, bufgrow = BUF_GROW;
+static unsigned long coldmax;
+#endif
 
 /*
- * Max: 9,999,999
+ * Max: 4,294,967,295
  */
 static char *
 putn(unsigned int n)
 {
-	static char num[8];
-	char tmp[7];
+	static char num[11];
+	char tmp[10];
 	int i = 0, j = 0;
 
 	do {
@@ -129,451 +252,5764 @@ strdcpy(char *dst, const char *src)
 	return i;
 }
 
-static char *
-ptr(int offset)
+#ifdef ANSI
+/*
+ * Terminal drivers.  Frames are built in obuf and written at once,
+ * and cup() picks the shortest way to move the cursor.
+ */
+struct term {
+	const char *init, *fini;
+	const char *clear, *home, *eol;
+	const char *rev, *norm;
+	const char *bsu, *esu;	/* Begin and end synchronized update */
+	int (*addr)(char *, int, int);
+};
+
+#ifndef VT52
+static int
+ansi_addr(char *seq, int r, int c)
 {
+	int i = 2;
+
+	seq[0] = '\033';
+	seq[1] = '[';
+	if (r > 0 || c > 0)
+		i += strdcpy(seq + i, putn(r + 1));
+	if (c > 0) {
+		seq[i++] = ';';
+		i += strdcpy(seq + i, putn(c + 1));
+	}
+	seq[i++] = 'H';
 
-	if (offset < 0)
-		return buf;
-
-	return (buf + offset + (buf + offset < gap ? 0 : egap - gap));
+	return i;
 }
+#endif
 
 static int
-pos(char *pointer)
+vt52_addr(char *seq, int r, int c)
 {
 
-	return (pointer - buf - (pointer < egap ? 0 : egap - gap));
+	seq[0] = '\033';
+	seq[1] = 'Y';
+	seq[2] = r + ' ';
+	seq[3] = c + ' ';
+
+	return 4;
 }
 
-static void
-movegap(void)
-{
-	char *p = ptr(idx);
+#ifndef VT52
+static const struct term ansi = {
+#if defined(__cpm__) || defined(__msdos__)
+	"\033[12h", "\033[12l",
+#else
+	"", "",
+#endif
+	"\033[H\033[J", "\033[H", "\033[K",
+	"\033[7m", "\033[0m",
+	"\033[?2026h", "\033[?2026l",
+	ansi_addr
+};
+#endif
 
-	while (p < gap)
-		*--egap = *--gap;
+/*
+ * VT52 has no standout; ESC p and ESC q are the common
+ * H19 extension and are ignored elsewhere.
+ */
+static const struct term vt52 = {
+	"", "",
+	"\033H\033J", "\033H", "\033K",
+	"\033p", "\033q",
+	"", "",
+	vt52_addr
+};
+
+#ifdef VT52
+static const struct term *term = &vt52;
+#else
+static const struct term *term = &ansi;
+#endif
 
-	while (egap < p)
-		*gap++ = *egap++;
+static char obuf[(ROW_MAX + 1) * (COL_MAX + 16)];
+static int olen, niov, trow, tcol, tknown, tsync;
 
-	idx = pos(egap);
+#ifdef __unix__
+/*
+ * Frames go out with writev(2): runs of obuf interleaved with
+ * text referenced in place.
+ */
+static struct iovec iov[(ROW_MAX + 1) * 4];
+static int ostart;
+#endif
+
+/*
+ * What the terminal shows, as of the last frame sent.
+ */
+static char shadow[ROW_MAX][COL_MAX];
+static char blanks[COL_MAX];
+static int garbled = 1, stale;
+
+/*
+ * Rows of plain text are shown straight from the buffer, in
+ * up to two pieces split at the gap.
+ */
+static struct {
+	char *p[2];
+	int n[2];
+} drow[ROW_MAX - 1];
+
+static void
+flush(void)
+{
+
+#ifdef __unix__
+	if (ostart < olen) {
+		iov[niov].iov_base = obuf + ostart;
+		iov[niov++].iov_len = olen - ostart;
+	}
+	if (niov > 0)
+		writev(1, iov, niov);
+	niov = ostart = 0;
+#else
+	if (olen > 0)
+		write(1, obuf, olen);
+#endif
+	olen = 0;
 }
 
-static int
-prevline(int offset)
+static void
+out(const char *s, int n)
 {
-	char *p;
 
-	while (buf < (p = ptr(--offset)) && *p != '\n')
-		;
+	if (sizeof(obuf) - olen < n)
+		flush();
 
-	return (buf < p ? ++offset : 0);
+	if (sizeof(obuf) < n) {
+		write(1, s, n);
+		return;
+	}
+
+	memcpy(obuf + olen, s, n);
+	olen += n;
 }
 
-static int
-nextline(int offset)
+static void
+outs(const char *s)
 {
-	char *p;
-
-	while ((p = ptr(offset++)) < ebuf && *p != '\n')
-		;
 
-	return (p < ebuf ? offset : pos(ebuf));
+	out(s, strlen(s));
 }
 
-static int
-adjust(int offset, int column)
+/*
+ * Queue n bytes that stay put until the next flush().
+ */
+static void
+outref(const char *s, int n)
 {
-	char *p;
-	int i = 0;
 
-	while ((p = ptr(offset)) < ebuf && *p != '\n' && i < column) {
-		i += (*p == '\t') ? 8 - (i & 7) : 1;
-		++offset;
+#ifdef __unix__
+	/*
+	 * writev(2) fails on a packed chunk rather than faulting.
+	 */
+	if (coldmax != 0) {
+		out(s, n);
+		return;
 	}
 
-	return offset;
+	if (sizeof(iov) / sizeof(iov[0]) < niov + 3)
+		flush();
+
+	if (ostart < olen) {
+		iov[niov].iov_base = obuf + ostart;
+		iov[niov++].iov_len = olen - ostart;
+		ostart = olen;
+	}
+	iov[niov].iov_base = (char *) s;
+	iov[niov++].iov_len = n;
+#else
+	out(s, n);
+#endif
 }
 
+/*
+ * Printable text; the cursor is lost once it reaches the margin.
+ */
 static void
-left(void)
+text(const char *s, int n)
 {
 
-	if (0 < idx)
-		--idx;
+	out(s, n);
+	if (COL_MAX <= (tcol += n))
+		tknown = 0;
 }
 
 static void
-right(void)
+textref(const char *s, int n)
 {
 
-	if (idx < pos(ebuf))
-		++idx;
+	outref(s, n);
+	if (COL_MAX <= (tcol += n))
+		tknown = 0;
 }
 
-static void
-up(void)
+/*
+ * Cheapest sequence from the known cursor position to (r, c).
+ * A newline on the bottom rows could scroll the terminal, so
+ * they are always addressed.
+ */
+static int
+route(const char **seq, char *addr, int r, int c)
 {
+	int len, n;
+
+	*seq = addr;
+	len = term->addr(addr, r, c);
+
+	if (r == 0 && c == 0 && (n = strlen(term->home)) < len) {
+		*seq = term->home;
+		len = n;
+	}
+
+	if (!tknown)
+		return len;
+
+	if (r == trow && c == tcol) {
+		len = 0;
+	} else if (r == trow && c == 0) {
+		*seq = "\r";
+		len = 1;
+	} else if (r == trow + 1 && r < ROW_MAX - 1 && c == tcol) {
+		*seq = "\n";
+		len = 1;
+	} else if (r == trow + 1 && r < ROW_MAX - 1 && c == 0 && 2 < len) {
+		*seq = "\r\n";
+		len = 2;
+	} else if (r == trow && c < tcol && tcol - c < len && tcol - c <= 8) {
+		*seq = "\b\b\b\b\b\b\b\b";
+		len = tcol - c;
+	}
 
-	idx = adjust(prevline(prevline(idx) - 1), col);
+	return len;
 }
 
 static void
-down(void)
+cup(int r, int c)
 {
+	const char *seq;
+	char addr[16];
 
-	idx = adjust(nextline(idx), col);
+	out(seq, route(&seq, addr, r, c));
+
+	trow = r;
+	tcol = c;
+	tknown = 1;
 }
 
 static void
-insert(int ch)
+clear(void)
 {
 
-	movegap();
-
-	if (ch == '\b' || ch == '\177') {
-		if (buf < gap)
-			--gap;
-	} else if (gap < egap) {
-		*gap++ = ((ch == '\r') ? '\n' : ch);
-	}
-
-	idx = pos(egap);
+	outs(term->clear);
+	trow = tcol = 0;
+	tknown = 1;
 }
 
-static unsigned int
-get_linecolno(void)
+/*
+ * Bring a row up to date with what the terminal shows, writing
+ * only the changed span and erasing a blank tail when cheaper.
+ */
+static void
+put_row(int r, const char *s, char *old, int standout)
 {
-	int i = 0;
-	unsigned int colno = 0;
+	int f, l, n;
 
-	line = 1;
-	while (i < idx) {
-		if (buf[i++] == '\n') {
-			++line;
-			colno = 0;
-		} else {
-			++colno;
-		}
+	for (f = 0; f < COL_MAX && s[f] == old[f]; f++)
+		;
+	if (f == COL_MAX)
+		return;
+
+	for (l = COL_MAX; s[l - 1] == old[l - 1]; l--)
+		;
+	/*
+	 * Erasing to the end of the line is only right where all of
+	 * s from n on is blank, unchanged columns included.
+	 */
+	for (n = COL_MAX; f < n && s[n - 1] == ' '; n--)
+		;
+
+	cup(r, f);
+	if (standout) {
+		outs(term->rev);
+		text(s + f, l - f);
+		outs(term->norm);
+	} else if (n < l && strlen(term->eol) < l - n) {
+		text(s + f, n - f);
+		outs(term->eol);
+	} else {
+		text(s + f, l - f);
 	}
 
-	return colno;
+	memcpy(old, s, COL_MAX);
 }
 
+/*
+ * Like put_row(), for row i shown straight from the buffer.
+ * Only the comparison with the shadow touches its bytes.
+ */
 static void
-update_modeline(unsigned int colno)
+put_direct(int r, int i, char *old)
 {
-	unsigned int i, rest;
+	char *p[3];
+	int c, f, k, l, n[3], off;
+
+	p[0] = drow[i].p[0];
+	p[1] = drow[i].p[1];
+	p[2] = blanks;
+	n[0] = drow[i].n[0];
+	n[1] = drow[i].n[1];
+	n[2] = COL_MAX - n[0] - n[1];
+
+	f = 0;
+	for (k = 0; k < 3; k++) {
+		for (c = 0; c < n[k] && p[k][c] == old[f]; c++)
+			++f;
+		if (c < n[k])
+			break;
+	}
+	if (f == COL_MAX)
+		return;
 
-	for (i = 0; i < sizeof(modeline); i++)
-		modeline[i] = '\0';
+	l = COL_MAX;
+	for (k = 2; 0 <= k; k--) {
+		for (c = n[k]; 0 < c && p[k][c - 1] == old[l - 1]; c--)
+			--l;
+		if (0 < c)
+			break;
+	}
 
-	i = strdcpy(modeline, "VCE: ");
+	cup(r, f);
+	for (k = 0, off = 0; k < 3; off += n[k++]) {
+		if (l <= off || off + n[k] <= f)
+			continue;
+		c = (f < off) ? 0 : f - off;
+		if (k == 2 && strlen(term->eol) < l - off - c)
+			outs(term->eol);
+		else
+			textref(p[k] + c, ((l < off + n[k]) ? l - off : n[k]) - c);
+	}
 
-	if (filename[0] != '\0')
-		i += strdcat(modeline, filename, COL_MAX > 21 ? 16 : 11);
+	memcpy(old, p[0], n[0]);
+	memcpy(old + n[0], p[1], n[1]);
+	memset(old + n[0] + n[1], ' ', n[2]);
+}
 
-	if (COL_MAX > 34) {
-		while (i < 21)
-			i += strdcat(modeline, " ", 1);
-		i += strdcat(modeline, "L: ", 3);
-		i += strdcat(modeline, putn(line), strlen(putn(line)));
+#ifdef __unix__
+/*
+ * True when the terminal has yet to drain what was sent to it.
+ * Ptys report an empty queue and only stop accepting writes.
+ */
+static int
+backlogged(void)
+{
+	struct pollfd pfd;
+#ifdef TIOCOUTQ
+	int n;
 
-		if (COL_MAX > 48) {
-			while (i < 35)
-				i += strdcat(modeline, " ", 1);
-			i += strdcat(modeline, "C: ", 3);
-			i += strdcat(modeline, putn(colno), strlen(putn(colno)));
+	if (ioctl(1, TIOCOUTQ, &n) == 0 && BACKLOG < n)
+		return 1;
+#endif
 
-			if (COL_MAX > 64) {
-				while (i < COL_MAX - 13)
-					i += strdcat(modeline, " ", 1);
+	pfd.fd = 1;
+	pfd.events = POLLOUT;
 
-#if defined(__cpm__) || defined(__msdos__)
-				i += strdcat(modeline, "  ", 2);
+	return (poll(&pfd, 1, 0) == 0);
+}
 #endif
 
-				i += strdcat(modeline, "Rest: ", 6);
-
-				rest = BUF - (ebuf - egap) - (gap - buf);
+/*
+ * Send the frame in screen and modeline.  While the link is
+ * backed up nothing is sent; the next frame is diffed against
+ * the last one sent, so the display catches up in one step.
+ */
+static void
+present(void)
+{
+	int i, start;
 
 #ifdef __unix__
-				if (rest < 1000000)
-					i += strdcat(modeline, " ", 1);
-				if (rest < 100000)
-					i += strdcat(modeline, " ", 1);
+	if (!garbled && backlogged()) {
+		stale = 1;
+		return;
+	}
 #endif
+	stale = 0;
+
+	/*
+	 * Let the terminal show the frame all at once.
+	 */
+	if (tsync)
+		outs(term->bsu);
+	start = olen;
+
+	if (garbled) {
+		clear();
+		memset(shadow, ' ', sizeof(shadow));
+		memset(shadow[0], '\0', sizeof(shadow[0]));
+		memset(blanks, ' ', sizeof(blanks));
+		garbled = 0;
+	}
 
-				if (rest < 10000)
-					i += strdcat(modeline, " ", 1);
-				if (rest < 1000)
-					i += strdcat(modeline, " ", 1);
-				if (rest < 100)
-					i += strdcat(modeline, " ", 1);
-				if (rest < 10)
-					i += strdcat(modeline, " ", 1);
-				i += strdcat(modeline, putn(rest),
-					strlen(putn(rest)));
-			}
-		}
+	put_row(0, modeline, shadow[0], 1);
+	for (i = 0; i < ROW_MAX - 1; i++) {
+		if (drow[i].n[0] + drow[i].n[1] > 0)
+			put_direct(i + 1, i, shadow[i + 1]);
+		else
+			put_row(i + 1, screen[i], shadow[i + 1], 0);
 	}
 
-	while (i < COL_MAX)
-		i += strdcat(modeline, " ", 1);
+	cup(row + 1, col + gutter);
+
+	/*
+	 * Take back just the begin mark of an empty frame; what was
+	 * queued before it still has to go out.
+	 */
+	if (tsync) {
+		if (olen == start && niov == 0)
+			olen = start - strlen(term->bsu);
+		else
+			outs(term->esu);
+	}
+	flush();
 }
 
+#ifdef __unix__
+/*
+ * Ask whether the terminal supports synchronized updates (mode
+ * 2026) with DECRQM.  The reply arrives as input some time later
+ * and is handed to sync_reply(), so startup never waits on it.
+ */
 static void
-update_display(void)
+probe_sync(void)
 {
-	char *p;
-	int i, j, k;
 
-	for (i = 0; i < ROW_MAX - 1; i++) {
-		for (j = 0; j < COL_MAX; j++)
-			screen[i][j] = ' ';
+	if (*term->bsu != '\0') {
+		outs("\033[?2026$p");
+		flush();
 	}
+}
 
-	if (idx < page)
-		page = prevline(idx);
+/*
+ * Rest of a "CSI ? 2026 ; Ps $ y" reply; Ps 1 and 2 mean
+ * the mode is supported.
+ */
+static void
+sync_reply(void)
+{
+	char reply[16];
+	int ch, i = 0;
 
-	if (epage <= idx) {
-		page = nextline(idx);
-		i = ((page == pos(ebuf)) ? ROW_MAX - 3 : ROW_MAX - 1);
-		while (0 < i--)
-			page = prevline(page - 1);
+	while ((ch = fgetc(stdin)) != EOF && ch != 'y') {
+		if (i < sizeof(reply) - 1)
+			reply[i++] = ch;
 	}
+	reply[i] = '\0';
 
-	i = 0;
-	j = 0;
-	epage = page;
+	if (strncmp(reply, "2026;", 5) == 0)
+		tsync = (reply[5] == '1' || reply[5] == '2');
+}
+#endif
+#endif
 
-	while (1) {
-		if (idx == epage) {
-			row = i;
-			col = j;
-		}
-		p = ptr(epage);
-		if ((ROW_MAX - 1) <= i || ebuf <= p)
+static char *
+ptr(int offset)
+{
+
+	if (offset < 0)
+		return buf;
+
+	return (buf + offset + (buf + offset < gap ? 0 : egap - gap));
+}
+
+static int
+pos(char *pointer)
+{
+
+	return (pointer - buf - (pointer < egap ? 0 : egap - gap));
+}
+
+static int
+byteat(int offset)
+{
+
+	if (offset < 0 || pos(ebuf) <= offset)
+		return -1;
+
+	return (unsigned char) *ptr(offset);
+}
+
+static int
+isword(int ch)
+{
+
+	return (ch != -1 && ISWORD(ch));
+}
+
+/*
+ * Carry the region counts across one byte, as count() does for the
+ * whole buffer.  A word start is decided by the byte before it, so
+ * the byte after the edited one is recounted as well.  The region
+ * ends move the way marks do.
+ */
+static void
+sel_edit(int offset, int sign)
+{
+	int a, b, ch, in, next;
+
+	a = isword(byteat(offset - 1));
+	b = isword(byteat(offset + 1));
+	ch = byteat(offset);
+
+	in = (sello <= offset && offset < selhi);
+	next = (sign < 0) ? (sello <= offset + 1 && offset + 1 < selhi) : in;
+
+	/* Starts at offset and offset + 1 with the byte present ... */
+	if (in)
+		selwords += sign * (isword(ch) && !a);
+	if (next)
+		selwords += sign * (b && !isword(ch));
+
+	/* ... and the start the byte after has without it. */
+	if (next)
+		selwords -= sign * (b && !a);
+
+	if (in && ch == '\n')
+		sellf += sign;
+
+	if (offset < sello)
+		sello += sign;
+	if (offset < selhi)
+		selhi += sign;
+}
+
+/*
+ * Account for the byte at offset, after it was inserted (sign 1)
+ * or before it is deleted (sign -1).  Only its neighbours decide
+ * whether a word was split or joined.
+ */
+static void
+count(int offset, int sign)
+{
+	int a, b, ch;
+
+	if (selok && selversion == version) {
+		sel_edit(offset, sign);
+		++selversion;
+	}
+
+	a = isword(byteat(offset - 1));
+	b = isword(byteat(offset + 1));
+	ch = byteat(offset);
+
+	if (isword(ch) ? (!a && !b) : (a && b))
+		nwords += sign;
+
+	if (ch == '\n')
+		nlf += sign;
+
+	++version;
+}
+
+/*
+ * Words starting in [lo, hi), scanned a side of the gap at a time.
+ */
+static long
+starts(int lo, int hi)
+{
+	char *p, *e;
+	long n = 0;
+	int prev;
+
+	if (pos(ebuf) < hi)
+		hi = pos(ebuf);
+
+	prev = isword(byteat(lo - 1));
+	while (lo < hi) {
+		p = ptr(lo);
+		e = (p < gap) ? gap : ebuf;
+		if (hi - lo < e - p)
+			e = p + (hi - lo);
+		lo += e - p;
+		for (; p < e; p++) {
+			n += ISWORD(*p) && !prev;
+			prev = ISWORD(*p);
+		}
+	}
+
+	return n;
+}
+
+#ifdef __unix__
+/*
+ * Newline offsets, split at the gap like the text itself.  Those
+ * before the gap are stored as offsets, those after it as their
+ * distance from the end of the text, so typing never shifts them.
+ */
+static int *lines, nleft, nright, lcap;
+
+static void
+lines_grow(void)
+{
+	int *nlines, ncap;
+
+	if (nleft + nright < lcap)
+		return;
+
+	ncap = (lcap == 0) ? 1024 : lcap * 2;
+	if ((nlines = realloc(lines, ncap * sizeof(int))) == NULL) {
+		fprintf(stderr, "vce: unable to grow line index\n");
+		exit(1);
+	}
+	memmove(nlines + ncap - nright, nlines + lcap - nright,
+	    nright * sizeof(int));
+	lines = nlines;
+	lcap = ncap;
+}
+
+static void
+lines_push(int offset)
+{
+
+	lines_grow();
+	lines[nleft++] = offset;
+}
+
+/*
+ * Offset of the newline ending line n + 1.
+ */
+static int
+lines_at(int n)
+{
+
+	if (n < nleft)
+		return lines[n];
+
+	return pos(ebuf) - lines[lcap - nright + n - nleft];
+}
+
+/*
+ * Number of newlines before offset.
+ */
+static int
+lines_before(int offset)
+{
+	int lo = 0, hi = nleft + nright, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (lines_at(mid) < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Carry the newlines the gap is about to pass over to its other
+ * side.  Called before the text itself moves.
+ */
+static void
+lines_move(int offset)
+{
+	int len = pos(ebuf), n;
+
+	if (offset <= pos(gap)) {
+		n = lines_before(offset);
+		while (n < nleft)
+			lines[lcap - ++nright] = len - lines[--nleft];
+	} else {
+		while (nright > 0 && len - lines[lcap - nright] < offset)
+			lines[nleft++] = len - lines[lcap - nright--];
+	}
+}
+#endif
+
+#ifdef __unix__
+/*
+ * Snapshots give other threads a fixed copy of the text without
+ * copying it up front.  A new one is pinned: it points at the two
+ * spans around the gap.  Before an edit changes bytes in a pinned
+ * span, snap_detach() copies the spans aside and points every
+ * pinned snapshot at its copy, so the text a reader sees never
+ * changes.  The lock is held only while a block is copied out.
+ */
+struct snap {
+	pthread_mutex_t lock;
+	const char *s[2];
+	size_t n[2];
+	char *copy;
+	unsigned long version;
+	int refs, lost;
+	struct snap *next;
+};
+static struct snap *pinned;
+
+/*
+ * Returns a snapshot of the buffer as it is, held once for the
+ * caller, or NULL.
+ */
+static struct snap *
+snap_take(void)
+{
+	struct snap *sn;
+
+	if ((sn = calloc(1, sizeof(*sn))) == NULL)
+		return NULL;
+	if (pthread_mutex_init(&sn->lock, NULL) != 0) {
+		free(sn);
+		return NULL;
+	}
+
+	sn->s[0] = buf;
+	sn->n[0] = gap - buf;
+	sn->s[1] = egap;
+	sn->n[1] = ebuf - egap;
+	sn->version = version;
+	sn->refs = 2;
+	sn->next = pinned;
+	pinned = sn;
+
+	return sn;
+}
+
+static void
+snap_release(struct snap *sn)
+{
+	int refs;
+
+	pthread_mutex_lock(&sn->lock);
+	refs = --sn->refs;
+	pthread_mutex_unlock(&sn->lock);
+
+	if (refs == 0) {
+		pthread_mutex_destroy(&sn->lock);
+		free(sn->copy);
+		free(sn);
+	}
+}
+
+/*
+ * Copy up to n bytes at offset off into dst.  Returns the count,
+ * 0 at the end, or -1 if the text was lost for want of memory.
+ */
+static long
+snap_read(struct snap *sn, size_t off, char *dst, size_t n)
+{
+	size_t done = 0, k;
+	int i;
+
+	pthread_mutex_lock(&sn->lock);
+	for (i = 0; i < 2 && done < n && !sn->lost; i++) {
+		if (sn->n[i] <= off) {
+			off -= sn->n[i];
+			continue;
+		}
+		k = sn->n[i] - off;
+		if (n - done < k)
+			k = n - done;
+		memcpy(dst + done, sn->s[i] + off, k);
+		done += k;
+		off = 0;
+	}
+	i = sn->lost;
+	pthread_mutex_unlock(&sn->lock);
+
+	return i ? -1 : (long) done;
+}
+
+/*
+ * Unpin every snapshot before the buffer changes under it.
+ */
+static void
+snap_detach(void)
+{
+	struct snap *sn;
+	char *copy;
+
+	while ((sn = pinned) != NULL) {
+		pinned = sn->next;
+
+		pthread_mutex_lock(&sn->lock);
+		if (1 < sn->refs) {
+			if ((copy = malloc(sn->n[0] + sn->n[1] + 1)) == NULL) {
+				sn->lost = 1;
+			} else {
+				memcpy(copy, sn->s[0], sn->n[0]);
+				memcpy(copy + sn->n[0], sn->s[1], sn->n[1]);
+				sn->copy = copy;
+				sn->s[0] = copy;
+				sn->s[1] = copy + sn->n[0];
+			}
+		}
+		pthread_mutex_unlock(&sn->lock);
+
+		snap_release(sn);
+	}
+}
+
+/*
+ * Called before the byte at p is written.
+ */
+static void
+snap_write(const char *p)
+{
+	struct snap *sn;
+
+	for (sn = pinned; sn != NULL; sn = sn->next) {
+		if ((sn->s[0] <= p && p < sn->s[0] + sn->n[0]) ||
+		    (sn->s[1] <= p && p < sn->s[1] + sn->n[1])) {
+			snap_detach();
+			return;
+		}
+	}
+}
+
+/*
+ * A small LZ4-style block format: a token holds the literal
+ * count and match length less four, with 255s following either
+ * when it is 15 or more; then the literals, then the match's
+ * two-byte distance back.  The last sequence has no match.
+ */
+static unsigned char *
+lz_seq(unsigned char *o, const unsigned char *lit, int nlit, int off,
+    int len)
+{
+	unsigned char *tok = o++;
+	int k;
+
+	if ((k = nlit) < 15) {
+		*tok = k << 4;
+	} else {
+		*tok = 15 << 4;
+		for (k -= 15; 255 <= k; k -= 255)
+			*o++ = 255;
+		*o++ = k;
+	}
+	memcpy(o, lit, nlit);
+	o += nlit;
+
+	if (len == 0)
+		return o;
+
+	*o++ = off & 0xff;
+	*o++ = off >> 8;
+	if ((k = len - 4) < 15) {
+		*tok |= k;
+	} else {
+		*tok |= 15;
+		for (k -= 15; 255 <= k; k -= 255)
+			*o++ = 255;
+		*o++ = k;
+	}
+
+	return o;
+}
+
+/*
+ * Pack n bytes at s into dst, which has room for n + n / 255 +
+ * 16, hashing into the LZ_HASH slots of tab.  Returns the packed
+ * length.
+ */
+static int
+lz_pack(const char *src, int n, char *dst, int *tab)
+{
+	const unsigned char *anchor, *e, *m, *p, *s;
+	unsigned char *o;
+	unsigned long v;
+	int h, len;
+
+	memset(tab, 0, LZ_HASH * sizeof(int));
+	s = anchor = p = (const unsigned char *) src;
+	e = s + n;
+	o = (unsigned char *) dst;
+
+	while (p + 12 < e) {
+		v = p[0] | p[1] << 8 | (unsigned long) p[2] << 16 |
+		    (unsigned long) p[3] << 24;
+		h = ((v * 2654435761UL) & 0xffffffff) >> 18;
+		m = s + tab[h] - 1;
+		len = tab[h];
+		tab[h] = p - s + 1;
+		if (len == 0 || 65535 < p - m || memcmp(m, p, 4) != 0) {
+			p += 1 + ((p - anchor) >> 6);
+			continue;
+		}
+
+		for (len = 4; p + len < e - 5 && m[len] == p[len]; len++)
+			;
+		o = lz_seq(o, anchor, p - anchor, p - m, len);
+		p += len;
+		anchor = p;
+	}
+	o = lz_seq(o, anchor, e - anchor, 0, 0);
+
+	return o - (unsigned char *) dst;
+}
+
+static void
+lz_unpack(const char *src, int n, char *dst)
+{
+	const unsigned char *e, *s;
+	unsigned char *m, *o;
+	int k, len, t;
+
+	s = (const unsigned char *) src;
+	e = s + n;
+	o = (unsigned char *) dst;
+
+	while (s < e) {
+		t = *s++;
+		if ((len = t >> 4) == 15) {
+			do {
+				len += (k = *s++);
+			} while (k == 255);
+		}
+		memcpy(o, s, len);
+		o += len;
+		s += len;
+		if (s == e)
+			break;
+
+		m = o - (s[0] | s[1] << 8);
+		s += 2;
+		if ((len = (t & 15) + 4) == 19) {
+			do {
+				len += (k = *s++);
+			} while (k == 255);
+		}
+		if (len <= o - m) {
+			memcpy(o, m, len);
+			o += len;
+		} else {
+			while (len-- > 0)
+				*o++ = *m++;
+		}
+	}
+}
+
+#ifdef __linux__
+/*
+ * Under a cold limit the buffer is an anonymous mapping cut into
+ * chunks, and at most the limit's worth of them stay unpacked.
+ * The rest are packed, their pages given back and closed to all
+ * access.  Touching one faults, and the handler unpacks it read
+ * only, keeping the packed copy; a write faults again and opens
+ * it for writing, so text that is only read is packed once.  The
+ * stale copy of a written chunk is dropped outside the handler.
+ */
+struct cold {
+	char *pack;		/* Packed text, until the chunk is written */
+	int len;		/* Its length */
+	int prot;		/* How the chunk is mapped */
+	unsigned long used;	/* When it last faulted */
+};
+
+static struct cold *chunks;
+static size_t nchunks, nhot;
+static unsigned long coldtick;
+static long pagesz;
+static int coldtab[LZ_HASH], coldhold;
+
+static size_t
+cold_round(size_t n)
+{
+
+	return (n + pagesz - 1) / pagesz * pagesz;
+}
+
+static void
+cold_drop(struct cold *c)
+{
+
+	if (c->pack != NULL)
+		munmap(c->pack, cold_round(c->len));
+	c->pack = NULL;
+	c->len = 0;
+}
+
+/*
+ * Let go of chunk i, packing it first if it was written and its
+ * text is to be kept.  Returns -1 if there is no room to pack it.
+ */
+static int
+cold_freeze(size_t i, int keep)
+{
+	struct cold *c = &chunks[i];
+	char *p = buf + i * COLD_CHUNK, *q;
+	size_t n = cold_round(COLD_CHUNK + COLD_CHUNK / 255 + 16), k;
+
+	if (!keep || (c->prot & PROT_WRITE))
+		cold_drop(c);
+	if (keep && (c->prot & PROT_WRITE)) {
+		if ((q = mmap(NULL, n, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return -1;
+		c->len = lz_pack(p, COLD_CHUNK, q, coldtab);
+		if ((k = cold_round(c->len)) < n)
+			munmap(q + k, n - k);
+		c->pack = q;
+	}
+
+	madvise(p, COLD_CHUNK, MADV_DONTNEED);
+	mprotect(p, COLD_CHUNK, PROT_NONE);
+	if (c->prot != PROT_NONE)
+		--nhot;
+	c->prot = PROT_NONE;
+
+	return 0;
+}
+
+/*
+ * Open chunk i to prot, unpacking it if it was let go.  Only
+ * mprotect(2) and plain copying, as the fault handler runs it.
+ */
+static int
+cold_thaw(size_t i, int prot)
+{
+	struct cold *c = &chunks[i];
+	char *p = buf + i * COLD_CHUNK;
+
+	if (c->prot == PROT_NONE) {
+		if (mprotect(p, COLD_CHUNK, PROT_READ | PROT_WRITE) == -1)
+			return -1;
+		if (c->pack != NULL)
+			lz_unpack(c->pack, c->len, p);
+		++nhot;
+	}
+	if (mprotect(p, COLD_CHUNK, prot) == -1)
+		return -1;
+	c->prot = prot;
+	c->used = ++coldtick;
+
+	return 0;
+}
+
+/*
+ * Let go of the chunk used longest ago.  From the fault handler,
+ * only one that was not written, whose text is already packed,
+ * and not one of the last COLD_MIN used, so that a read spanning
+ * two chunks cannot keep closing the one it just opened.
+ */
+static int
+cold_evict(int fault)
+{
+	size_t i, v = nchunks;
+
+	for (i = 0; i < nchunks; i++) {
+		if (chunks[i].prot == PROT_NONE || (fault &&
+		    ((chunks[i].prot & PROT_WRITE) ||
+		    coldtick < chunks[i].used + COLD_MIN)))
+			continue;
+		if (v == nchunks || chunks[i].used < chunks[v].used)
+			v = i;
+	}
+
+	return (v == nchunks) ? -1 : cold_freeze(v, 1);
+}
+
+/*
+ * Pack the chunks used longest ago until the limit holds, unless
+ * coldhold is set.
+ */
+static void
+cold_limit(void)
+{
+
+	while (!coldhold && coldmax / COLD_CHUNK < nhot &&
+	    cold_evict(0) == 0)
+		;
+}
+
+/*
+ * The handler makes no allocation and packs nothing: it thaws
+ * the chunk and, so that long reads keep to the limit, lets go
+ * of chunks that were only read.  Written ones wait for
+ * cold_limit() outside it.  It uses only mprotect(2) and
+ * madvise(2), but reads and changes the chunk table, which is
+ * safe only because every access to a closed chunk is made by
+ * the main thread from plain code:
+ *
+ *	- outref() copies text rather than hand it to writev(2);
+ *	- cold_open() opens chunks before read(2) fills them;
+ *	- saves run in the foreground, copying from a snapshot.
+ *
+ * Any fault outside a closed chunk is left to kill vce.
+ */
+static void
+cold_fault(int sig, siginfo_t *si, void *ctx)
+{
+	char *p = si->si_addr;
+	size_t i = (p - buf) / COLD_CHUNK;
+
+	if (p < buf || buf + nchunks * COLD_CHUNK <= p ||
+	    (chunks[i].prot & PROT_WRITE) || cold_thaw(i,
+	    chunks[i].prot ? PROT_READ | PROT_WRITE : PROT_READ) == -1) {
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	while (!coldhold && coldmax / COLD_CHUNK < nhot &&
+	    cold_evict(1) == 0)
+		;
+}
+
+/*
+ * Open the chunks under n bytes at p for writing; read(2) fails
+ * on a closed chunk rather than faulting.
+ */
+static void
+cold_open(char *p, size_t n)
+{
+	size_t i;
+
+	if (coldmax == 0)
+		return;
+
+	for (i = (p - buf) / COLD_CHUNK;
+	    i < nchunks && buf + i * COLD_CHUNK < p + n; i++)
+		cold_thaw(i, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * Count the open chunks from p to e as just used.
+ */
+static void
+cold_use(char *p, char *e)
+{
+	size_t i;
+
+	if (p < buf)
+		p = buf;
+	for (i = (p - buf) / COLD_CHUNK;
+	    i < nchunks && buf + i * COLD_CHUNK <= e; i++) {
+		if (chunks[i].prot != PROT_NONE)
+			chunks[i].used = ++coldtick;
+	}
+}
+
+/*
+ * Between keys: chunks wholly in the gap are let go unpacked,
+ * written ones lose their stale packed copy, those on screen and
+ * at the gap count as used, and the others are packed oldest
+ * first until the limit holds.
+ */
+static void
+cold_trim(void)
+{
+	struct cold *c;
+	char *p;
+	size_t i;
+
+	if (coldmax == 0)
+		return;
+
+	for (i = 0; i < nchunks; i++) {
+		c = &chunks[i];
+		p = buf + i * COLD_CHUNK;
+		if (gap < p && p + COLD_CHUNK <= egap &&
+		    (c->prot != PROT_NONE || c->pack != NULL))
+			cold_freeze(i, 0);
+		else if (c->prot & PROT_WRITE)
+			cold_drop(c);
+	}
+
+	if (page < gap - buf && gap - buf <= epage) {
+		cold_use(ptr(page), gap);
+		cold_use(egap, ptr(epage));
+	} else {
+		cold_use(ptr(page), ptr(epage));
+	}
+	cold_use(gap - 1, gap);
+	cold_use(egap, egap);
+
+	cold_limit();
+}
+
+/*
+ * Give chunk from of the buffer to chunk to of the mapping at p.
+ */
+static void
+cold_move(struct cold *nc, char *p, size_t from, size_t to)
+{
+	struct cold *c = &chunks[from];
+
+	nc[to] = *c;
+	if (c->prot == PROT_NONE)
+		return;
+
+	p += to * COLD_CHUNK;
+	mprotect(p, COLD_CHUNK, PROT_READ | PROT_WRITE);
+	memcpy(p, buf + from * COLD_CHUNK, COLD_CHUNK);
+	mprotect(p, COLD_CHUNK, c->prot);
+	++nhot;
+}
+
+/*
+ * Map the buffer anew at size, a whole number of chunks, with
+ * its head in place and its last tail bytes at the end, as
+ * growbuf() wants.  Chunks move whole, packed or not.
+ */
+static char *
+cold_realloc(unsigned long size, unsigned long tail)
+{
+	struct cold *nc;
+	char *p;
+	size_t head, i, n = size / COLD_CHUNK, t;
+
+	head = (gap - buf + COLD_CHUNK - 1) / COLD_CHUNK;
+	t = (nchunks * COLD_CHUNK - tail) / COLD_CHUNK;
+
+	if ((nc = calloc(n, sizeof(*nc))) == NULL)
+		return NULL;
+	if ((p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+	    -1, 0)) == MAP_FAILED ||
+	    (t < head && cold_thaw(t, PROT_READ | PROT_WRITE) == -1)) {
+		if (p != MAP_FAILED)
+			munmap(p, size);
+		free(nc);
+		return NULL;
+	}
+	if (t < head)
+		cold_drop(&chunks[t]);
+
+	/*
+	 * A chunk holding both the head's end and the tail's start
+	 * was opened above and its packed text dropped, so that it
+	 * is copied rather than the packed text given twice.
+	 */
+	nhot = 0;
+	for (i = 0; i < nchunks; i++) {
+		if (i < head)
+			cold_move(nc, p, i, i);
+		if (t <= i)
+			cold_move(nc, p, i, i + n - nchunks);
+		if (head <= i && i < t)
+			cold_drop(&chunks[i]);
+	}
+
+	if (buf != NULL)
+		munmap(buf, nchunks * COLD_CHUNK);
+	free(chunks);
+	chunks = nc;
+	nchunks = n;
+
+	return p;
+}
+
+/*
+ * Start a packed buffer of bufsize, rounded to whole chunks.
+ */
+static char *
+cold_init(void)
+{
+	struct sigaction sa;
+
+	pagesz = sysconf(_SC_PAGESIZE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = cold_fault;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, NULL) == -1)
+		return NULL;
+
+	if (bufsize <= INT_MAX / COLD_CHUNK * COLD_CHUNK)
+		bufsize = (bufsize + COLD_CHUNK - 1) / COLD_CHUNK * COLD_CHUNK;
+	else
+		bufsize = INT_MAX / COLD_CHUNK * COLD_CHUNK;
+
+	return cold_realloc(bufsize, 0);
+}
+#endif
+
+/*
+ * Past the memory limit the buffer is a shared mapping of an
+ * unlinked temp file, whose pages live in the file.  Once about
+ * the limit's worth of them has been touched the mapping lets go
+ * of them all, and only those used again come back.
+ */
+static int pagefd = -1;
+static unsigned long touched;
+
+static unsigned long
+buflimit(void)
+{
+
+	return (pagefd == -1 && coldmax == 0) ? bufmax : INT_MAX;
+}
+
+/*
+ * Called as bulk work goes through n bytes, so the buffer keeps
+ * to its limit before the next key.
+ */
+static void
+page_touch(unsigned long n)
+{
+
+#ifdef __linux__
+	cold_limit();
+#endif
+	if (pagefd == -1 || (touched += n) < bufmax)
+		return;
+
+	madvise(buf, bufsize, MADV_DONTNEED);
+	touched = 0;
+}
+
+/*
+ * How much of n bytes to move at once.  A packed buffer is held
+ * to its limit between steps, as the fault handler cannot pack.
+ */
+static size_t
+page_step(size_t n)
+{
+
+	if (pagefd != -1 && bufmax / 4 + 1 < n)
+		n = bufmax / 4 + 1;
+	if (coldmax != 0 && coldmax / 4 < n)
+		n = coldmax / 4;
+	page_touch(2 * n);
+
+	return n;
+}
+#endif
+
+/*
+ * A paged buffer moves the gap a stretch at a time, letting go
+ * of the pages it has passed along the way.
+ */
+static void
+movegap(void)
+{
+	char *p = ptr(idx);
+	size_t k;
+
+#ifdef __unix__
+	if (pinned != NULL && p != egap)
+		snap_detach();
+	lines_move(idx);
+#endif
+
+	while (p < gap) {
+		k = gap - p;
+#ifdef __unix__
+		k = page_step(k);
+#endif
+		gap -= k;
+		egap -= k;
+		memmove(egap, gap, k);
+	}
+	while (egap < p) {
+		k = p - egap;
+#ifdef __unix__
+		k = page_step(k);
+#endif
+		memmove(gap, egap, k);
+		gap += k;
+		egap += k;
+	}
+
+	idx = pos(egap);
+}
+
+#ifdef __unix__
+/*
+ * Map the temp file at size in place of the buffer, keeping its
+ * contents as realloc() would.  The first call makes the file,
+ * in /var/tmp if the chosen directory is tmpfs, whose pages
+ * would stay in memory.
+ */
+static char *
+page_realloc(unsigned long size)
+{
+	static const char name[] = "/vceXXXXXX";
+	char path[PATH_MAX], *p;
+	const char *dir;
+	size_t n;
+	int fd;
+#ifdef __linux__
+	struct statfs fs;
+#endif
+
+	if ((fd = pagefd) == -1) {
+		if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0' ||
+		    sizeof(path) - sizeof(name) < strlen(dir))
+			dir = "/tmp";
+#ifdef __linux__
+		if (statfs(dir, &fs) == 0 && fs.f_type == TMPFS_MAGIC &&
+		    statfs("/var/tmp", &fs) == 0 && fs.f_type != TMPFS_MAGIC)
+			dir = "/var/tmp";
+#endif
+		n = strlen(dir);
+		memcpy(path, dir, n);
+		memcpy(path + n, name, sizeof(name));
+		if ((fd = mkstemp(path)) == -1)
+			return NULL;
+		unlink(path);
+	}
+
+	if (ftruncate(fd, size) == -1 || (p = mmap(NULL, size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		if (pagefd == -1)
+			close(fd);
+		return NULL;
+	}
+
+	if (pagefd == -1) {
+		memcpy(p, buf, bufsize);
+		free(buf);
+		pagefd = fd;
+	} else {
+		munmap(buf, bufsize);
+	}
+
+	return p;
+}
+
+/*
+ * Grow the buffer once the gap falls below the reserve.  Growing
+ * past the configured limit moves it to a temp file, unless it
+ * is packed, when it grows without one.
+ */
+static void
+growbuf(unsigned long need)
+{
+	char *nbuf;
+	unsigned long size, head, tail, limit, osize;
+	size_t k, n;
+	int paged;
+
+	if ((unsigned long) (egap - gap) >= need + bufgap)
+		return;
+
+	head = gap - buf;
+	tail = ebuf - egap;
+
+	paged = (pagefd != -1 || bufmax < head + tail + need + bufgap);
+	limit = paged ? INT_MAX : bufmax;
+	if (coldmax != 0) {
+		paged = 0;
+		limit = INT_MAX / COLD_CHUNK * COLD_CHUNK;
+	}
+	if (bufsize >= limit)
+		return;
+
+	size = bufsize * bufgrow / 10;
+	if (size < head + tail + need + bufgap)
+		size = head + tail + need + bufgap;
+	if (coldmax != 0)
+		size = (size + COLD_CHUNK - 1) / COLD_CHUNK * COLD_CHUNK;
+	if (size > limit)
+		size = limit;
+
+	if (pinned != NULL)
+		snap_detach();
+
+#ifdef __linux__
+	if (coldmax != 0)
+		nbuf = cold_realloc(size, tail);
+	else
+#endif
+	nbuf = paged ? page_realloc(size) : realloc(buf, size);
+	if (nbuf == NULL)
+		return;
+
+	osize = bufsize;
+	buf = nbuf;
+	bufsize = size;
+
+	/*
+	 * The tail moves up from its end, a stretch at a time, so a
+	 * paged buffer lets go of the pages it has passed.  A packed
+	 * buffer's has already moved.
+	 */
+	for (n = (coldmax != 0) ? 0 : tail; 0 < n; n -= k) {
+		k = page_step(n);
+		memmove(buf + size - tail + n - k,
+		    buf + osize - tail + n - k, k);
+	}
+
+	gap = buf + head;
+	ebuf = buf + size;
+	egap = ebuf - tail;
+}
+#endif
+
+static int
+prevline(int offset)
+{
+	char *p;
+
+	while (buf < (p = ptr(--offset)) && *p != '\n')
+		;
+
+	return (buf < p ? ++offset : 0);
+}
+
+static int
+nextline(int offset)
+{
+	char *p;
+
+	while ((p = ptr(offset++)) < ebuf && *p != '\n')
+		;
+
+	return (p < ebuf ? offset : pos(ebuf));
+}
+
+static int
+adjust(int offset, int column)
+{
+	char *p;
+	int i = 0;
+
+	while ((p = ptr(offset)) < ebuf && *p != '\n' && i < column) {
+		i += (*p == '\t') ? 8 - (i & 7) : 1;
+		++offset;
+	}
+
+	return offset;
+}
+
+static int
+line_of(int offset)
+{
+#ifdef __unix__
+	return lines_before(offset) + 1;
+#else
+	int i, n = 1;
+
+	for (i = 0; i < offset; i++) {
+		if (*ptr(i) == '\n')
+			++n;
+	}
+
+	return n;
+#endif
+}
+
+/*
+ * Offset of the start of line n, or of the last line.
+ */
+static int
+line_start(int n)
+{
+#ifdef __unix__
+	if (n <= 1 || nleft + nright == 0)
+		return 0;
+
+	if (nleft + nright < n - 1)
+		n = nleft + nright + 1;
+
+	return lines_at(n - 2) + 1;
+#else
+	int offset = 0;
+
+	while (1 < n-- && offset < pos(ebuf))
+		offset = nextline(offset);
+
+	return offset;
+#endif
+}
+
+/*
+ * Count words and newlines a block at a time, in a loop simple
+ * enough for the compiler to vectorize, and let memchr() find
+ * the newlines for the index only in blocks that have some.
+ */
+static void
+scan(char *s, char *e, int offset, int prev)
+{
+	char *p, *end;
+	long n, w;
+#ifdef __unix__
+	char *q;
+#endif
+
+	for (; s < e; offset += end - s, s = end) {
+		end = (e - s > 4096) ? s + 4096 : e;
+
+		w = isword((unsigned char) *s) && !isword(prev);
+		n = (*s == '\n');
+		for (p = s + 1; p < end; p++) {
+			w += ISWORD(p[0]) & !ISWORD(p[-1]);
+			n += (p[0] == '\n');
+		}
+		prev = (unsigned char) end[-1];
+
+		nwords += w;
+		nlf += n;
+
+#ifdef __unix__
+		for (q = s; n > 0; q++, n--) {
+			q = memchr(q, '\n', end - q);
+			lines_push(offset + (q - s));
+		}
+		page_touch(end - s);
+#endif
+	}
+}
+
+/*
+ * Recount the whole buffer, e.g. after loading a file.
+ */
+static void
+lines_build(void)
+{
+
+	nwords = nlf = 0;
+#ifdef __unix__
+	nleft = nright = 0;
+#endif
+
+	scan(buf, gap, 0, -1);
+	scan(egap, ebuf, pos(gap), byteat(pos(gap) - 1));
+
+#ifdef __unix__
+	lines_move(pos(gap));
+#endif
+	++version;
+}
+
+static void
+mark_add(int slot, int delta)
+{
+
+	for (; slot <= nmarks; slot += slot & -slot)
+		marktree[slot] += delta;
+}
+
+static int
+mark_pos(int slot)
+{
+	int offset = 0;
+
+	for (; slot > 0; slot -= slot & -slot)
+		offset += marktree[slot];
+
+	return offset;
+}
+
+/*
+ * Number of marks at or before offset.
+ */
+static int
+mark_find(int offset)
+{
+	int i = 0, step = 1;
+
+	while (step * 2 <= nmarks)
+		step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (i + step <= nmarks && marktree[i + step] <= offset) {
+			i += step;
+			offset -= marktree[i];
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Turn the tree into plain positions and back, for the
+ * rare operations that add or remove marks.
+ */
+static void
+mark_unpack(void)
+{
+	int i, j;
+
+	for (i = nmarks; i > 0; i--) {
+		if ((j = i + (i & -i)) <= nmarks)
+			marktree[j] -= marktree[i];
+	}
+
+	for (i = 2; i <= nmarks; i++)
+		marktree[i] += marktree[i - 1];
+}
+
+static void
+mark_pack(void)
+{
+	int i, j;
+
+	for (i = nmarks; i > 1; i--)
+		marktree[i] -= marktree[i - 1];
+
+	for (i = 1; i <= nmarks; i++) {
+		if ((j = i + (i & -i)) <= nmarks)
+			marktree[j] += marktree[i];
+	}
+}
+
+static void
+mark_del(int slot)
+{
+
+	mark_unpack();
+	for (; slot < nmarks; slot++) {
+		marktree[slot] = marktree[slot + 1];
+		markname[slot] = markname[slot + 1];
+	}
+	--nmarks;
+	mark_pack();
+}
+
+static int
+mark_get(int name)
+{
+	int i;
+
+	for (i = 1; i <= nmarks; i++) {
+		if (markname[i] == name)
+			return i;
+	}
+
+	return 0;
+}
+
+/*
+ * Named marks are unique; '!' marks and fold ends may repeat.
+ */
+static int
+mark_set(int name, int offset)
+{
+	int i, slot;
+
+	if (strchr("!{}", name) == NULL && (slot = mark_get(name)) != 0)
+		mark_del(slot);
+
+	if (nmarks == MARK_MAX)
+		return -1;
+
+	slot = mark_find(offset) + 1;
+
+	mark_unpack();
+	for (i = ++nmarks; i > slot; i--) {
+		marktree[i] = marktree[i - 1];
+		markname[i] = markname[i - 1];
+	}
+	marktree[slot] = offset;
+	markname[slot] = name;
+	mark_pack();
+
+	return 0;
+}
+
+/*
+ * Called by the edit primitives: delta bytes were inserted at
+ * offset, or -delta bytes were deleted starting there.  Marks
+ * inside a deleted range collapse onto its start.
+ */
+static void
+mark_shift(int offset, int delta)
+{
+	int d, slot, end;
+
+	slot = mark_find(offset) + 1;
+
+	if (delta < 0) {
+		for (end = mark_find(offset - delta) + 1; slot < end; slot++) {
+			if ((d = offset - mark_pos(slot)) != 0) {
+				mark_add(slot, d);
+				mark_add(slot + 1, -d);
+			}
+		}
+	}
+
+	mark_add(slot, delta);
+}
+
+/*
+ * Folds are pairs of '{' and '}' marks around the lines they
+ * hide, so edits move them like any mark.  Folds never touch, so
+ * the two kinds alternate in mark order and the nearest one at
+ * or before an offset tells whether it is hidden.
+ */
+static int nfolds;
+
+static int
+fold_prev(int slot)
+{
+
+	while (0 < slot && markname[slot] != '{' && markname[slot] != '}')
+		--slot;
+
+	return slot;
+}
+
+static int
+fold_next(int slot)
+{
+
+	while (slot <= nmarks && markname[slot] != '{' &&
+	    markname[slot] != '}')
+		++slot;
+
+	return slot;
+}
+
+/*
+ * Slot of the '{' of the fold hiding offset, or 0.
+ */
+static int
+fold_find(int offset)
+{
+	int slot;
+
+	if (nfolds == 0)
+		return 0;
+
+	slot = fold_prev(mark_find(offset));
+
+	return (0 < slot && markname[slot] == '{') ? slot : 0;
+}
+
+/*
+ * If offset is hidden, the end of its fold for dir > 0, or the
+ * end of the line before the fold otherwise.
+ */
+static int
+fold_out(int offset, int dir)
+{
+	int a, slot;
+
+	if ((slot = fold_find(offset)) == 0)
+		return offset;
+
+	a = mark_pos(slot);
+	if (0 < dir || a == 0)
+		return mark_pos(fold_next(slot + 1));
+
+	return a - 1;
+}
+
+static void
+fold_del(int slot)
+{
+
+	mark_del(fold_next(slot + 1));
+	mark_del(slot);
+	--nfolds;
+}
+
+static void
+left(void)
+{
+
+	nibble = 0;
+	if (0 < idx)
+		--idx;
+	if (!hexmode)
+		idx = fold_out(idx, -1);
+}
+
+static void
+right(void)
+{
+
+	nibble = 0;
+	if (idx < pos(ebuf))
+		++idx;
+	if (!hexmode)
+		idx = fold_out(idx, 1);
+}
+
+static void
+up(void)
+{
+
+	if (hexmode) {
+		nibble = 0;
+		if (HEX_W <= idx)
+			idx -= HEX_W;
+		return;
+	}
+
+	idx = adjust(prevline(fold_out(prevline(idx) - 1, -1)), col);
+}
+
+static void
+down(void)
+{
+
+	if (hexmode) {
+		nibble = 0;
+		if (idx + HEX_W <= pos(ebuf))
+			idx += HEX_W;
+		return;
+	}
+
+	idx = adjust(fold_out(nextline(idx), 1), col);
+}
+
+/*
+ * The undo log.  Each change replaced len old bytes at lo, kept
+ * on a stack in utext, with n new ones.  Changes made by one
+ * command share a group and are undone together; typing in one
+ * place grows the change on top instead of adding more.  On Unix
+ * the old text of big changes is packed into size bytes; size is
+ * 0 for text kept as is.
+ */
+struct undo {
+	int lo, n, len, size, group;
+};
+
+static struct undo undos[UNDO_MAX];
+static int nundo, ugroup, ingroup, undoing, utyping;
+#ifdef __unix__
+static char *utext;
+static int ucap;
+#else
+static char utext[UNDO_BYTES];
+#endif
+static int ulen;
+
+static void
+undo_clear(void)
+{
+
+	nundo = ulen = 0;
+	utyping = 0;
+}
+
+/*
+ * Forget the oldest k changes.
+ */
+static void
+undo_drop(int k)
+{
+	int i, n;
+
+	for (i = n = 0; i < k; i++)
+		n += undos[i].size ? undos[i].size : undos[i].len;
+	memmove(utext, utext + n, ulen - n);
+	ulen -= n;
+	memmove(undos, undos + k, (nundo - k) * sizeof(struct undo));
+	nundo -= k;
+}
+
+static int
+undo_room(int len)
+{
+#ifdef __unix__
+	char *p;
+	int cap;
+
+	if (ucap < ulen + len) {
+		for (cap = ucap ? ucap : 1024; cap < ulen + len; )
+			cap *= 2;
+		if ((p = realloc(utext, cap)) == NULL)
+			return -1;
+		utext = p;
+		ucap = cap;
+	}
+
+	return 0;
+#else
+	return (UNDO_BYTES < ulen + len) ? -1 : 0;
+#endif
+}
+
+#ifdef __unix__
+/*
+ * Append the len bytes at s to utext packed, a block at a time,
+ * each stored after its packed length; a block that does not
+ * shrink is stored as is.  Returns the bytes used, or -1.
+ */
+static int
+undo_pack(const char *s, int len)
+{
+	static char out[LZ_BLOCK + LZ_BLOCK / 255 + 16];
+	static int tab[LZ_HASH];
+	int b, k, start = ulen;
+
+	for (; 0 < len; s += b, len -= b) {
+		b = (len < LZ_BLOCK) ? len : LZ_BLOCK;
+		if ((k = lz_pack(s, b, out, tab)) >= b)
+			k = b;
+		if (undo_room(sizeof(int) + k) == -1) {
+			ulen = start;
+			return -1;
+		}
+		memcpy(utext + ulen, &k, sizeof(int));
+		memcpy(utext + ulen + sizeof(int), (k < b) ? out : s, k);
+		ulen += sizeof(int) + k;
+	}
+
+	return ulen - start;
+}
+
+static void
+undo_unpack(const char *s, char *dst, int len)
+{
+	int b, k;
+
+	for (; 0 < len; dst += b, len -= b) {
+		b = (len < LZ_BLOCK) ? len : LZ_BLOCK;
+		memcpy(&k, s, sizeof(int));
+		s += sizeof(int);
+		if (k == b)
+			memcpy(dst, s, b);
+		else
+			lz_unpack(s, k, dst);
+		s += k;
+	}
+}
+#endif
+
+/*
+ * Append old text to utext, packed if it is big.  Returns the
+ * packed size, 0 if it is kept as is, or -1.  Text beyond the
+ * memory limit of a paged buffer is not kept.
+ */
+static int
+undo_keep(const char *s, int len)
+{
+
+	if (len == 0)
+		return 0;
+#ifdef __unix__
+	if (pagefd != -1 && bufmax < (unsigned long) len)
+		return -1;
+	if (UNDO_PACK <= len)
+		return undo_pack(s, len);
+#endif
+	if (undo_room(len) == -1)
+		return -1;
+	memcpy(utext + ulen, s, len);
+	ulen += len;
+
+	return 0;
+}
+
+/*
+ * Start a change of the len bytes at s, which are at lo.  A
+ * change that cannot be kept empties the log, since the changes
+ * under it would no longer line up.
+ */
+static struct undo *
+undo_push(int lo, const char *s, int len)
+{
+	struct undo *u;
+	int size;
+
+	if (undoing)
+		return NULL;
+
+	if (nundo == UNDO_MAX)
+		undo_drop(UNDO_MAX / 4);
+#ifndef __unix__
+	while (0 < nundo && undo_room(len) == -1)
+		undo_drop(1);
+#endif
+	if ((size = undo_keep(s, len)) == -1) {
+		undo_clear();
+		return NULL;
+	}
+
+	if (!ingroup)
+		++ugroup;
+
+	u = &undos[nundo++];
+	u->lo = lo;
+	u->n = 0;
+	u->len = len;
+	u->size = size;
+	u->group = ugroup;
+	utyping = 0;
+
+	return u;
+}
+
+/*
+ * Fold typing into the change on top when it touches its end,
+ * or deletes just before it.
+ */
+static int
+undo_merge(int at, const char *old, int n)
+{
+	struct undo *u;
+
+	if (nundo == 0 || !utyping || ingroup)
+		return -1;
+
+	u = &undos[nundo - 1];
+	if (at == u->lo + u->n) {
+		if (old != NULL) {
+			if (undo_room(1) == -1)
+				return -1;
+			utext[ulen++] = *old;
+			u->len++;
+		}
+		u->n += n;
+	} else if (old != NULL && n == 0 && 0 < u->n &&
+	    at + 1 == u->lo + u->n) {
+		u->n--;
+	} else if (old != NULL && n == 0 && at + 1 == u->lo) {
+		if (undo_room(1) == -1)
+			return -1;
+		memmove(utext + ulen - u->len + 1, utext + ulen - u->len,
+		    u->len);
+		utext[ulen - u->len] = *old;
+		ulen++;
+		u->len++;
+		u->lo--;
+	} else if (old == NULL || n == 0 ||
+	    at < u->lo || u->lo + u->n <= at) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Typing at offset at replaced the byte at old, or nothing if old
+ * is NULL, with n new bytes.
+ */
+static void
+undo_typed(int at, const char *old, int n)
+{
+	struct undo *u;
+
+	if (undoing || undo_merge(at, old, n) == 0)
+		return;
+
+	if ((u = undo_push(at, old, old != NULL)) != NULL) {
+		u->n = n;
+		utyping = 1;
+	}
+}
+
+/*
+ * Insert ch, or delete before the cursor, with the gap already
+ * at the cursor and room for one byte.
+ */
+static void
+edit(int ch)
+{
+
+	if (ch == '\b' || ch == '\177') {
+		if (buf < gap) {
+			undo_typed(idx - 1, gap - 1, 0);
+			count(idx - 1, -1);
+#ifdef __unix__
+			if (gap[-1] == '\n')
+				--nleft;
+#endif
+			--gap;
+			mark_shift(idx - 1, -1);
+			dirty = 1;
+		}
+	} else if (gap < egap) {
+#ifdef __unix__
+		snap_write(gap);
+#endif
+		undo_typed(idx, NULL, 1);
+		*gap++ = ((ch == '\r') ? '\n' : ch);
+#ifdef __unix__
+		if (gap[-1] == '\n')
+			lines_push(idx);
+#endif
+		count(idx, 1);
+		mark_shift(idx, 1);
+		dirty = 1;
+	}
+
+	idx = pos(egap);
+}
+
+static void
+insert(int ch)
+{
+
+	movegap();
+
+#ifdef __unix__
+	growbuf(1);
+#endif
+
+	edit(ch);
+}
+
+/*
+ * Type ch at every cursor in one pass.  The gap opens at the first
+ * cursor, and the text up to the last streams through it, taking
+ * the key at each cursor on the way.  The newlines passed over
+ * keep their entries past the gap until the end, when they and
+ * any typed ones are carried in front of it together.
+ */
+static void
+multi_insert(int ch)
+{
+	int at[CURSOR_MAX + 1], d[CURSOR_MAX + 1];
+	int delta = 0, i, j, n, primary;
+	char *p;
+	size_t k;
+#ifdef __unix__
+	int len, o;
+#endif
+
+	for (i = j = n = 0; i < ncursors || j == 0; n++) {
+		if (j == 0 && (i == ncursors || idx <= cursors[i])) {
+			primary = n;
+			at[n] = idx;
+			j = 1;
+		} else {
+			at[n] = cursors[i++];
+		}
+	}
+
+#ifdef __unix__
+	growbuf(n);
+#endif
+	idx = at[0];
+	movegap();
+#ifdef __unix__
+	if (pinned != NULL)
+		snap_detach();
+	len = pos(ebuf);
+#endif
+	if (ch == '\r')
+		ch = '\n';
+
+	++ugroup;
+	ingroup = 1;
+	for (i = 0; i < n; i++) {
+		p = ptr(at[i] + delta);
+		while (egap < p) {
+			k = p - egap;
+#ifdef __unix__
+			k = page_step(k);
+#endif
+			memmove(gap, egap, k);
+			gap += k;
+			egap += k;
+		}
+
+		d[i] = 0;
+		if (ch == '\b' || ch == '\177') {
+			if (buf < gap) {
+				undo_typed(pos(gap) - 1, gap - 1, 0);
+				count(pos(gap) - 1, -1);
+#ifdef __unix__
+				if (i == 0 && gap[-1] == '\n')
+					--nleft;
+#endif
+				--gap;
+				mark_shift(pos(gap), -1);
+				d[i] = -1;
+			}
+		} else if (gap < egap) {
+			undo_typed(pos(gap), NULL, 1);
+			*gap++ = ch;
+			count(pos(gap) - 1, 1);
+			mark_shift(pos(gap) - 1, 1);
+			d[i] = 1;
+		}
+		delta += d[i];
+	}
+	ingroup = 0;
+	dirty = 1;
+
+#ifdef __unix__
+	/*
+	 * o is where a newline passed over was before the key, and
+	 * delta what the cursors up to it have added since.
+	 */
+	for (i = 0, delta = 0; ; ) {
+		o = (0 < nright) ? len - lines[lcap - nright] : INT_MAX;
+		if (at[n - 1] <= o)
+			o = INT_MAX;
+		for (; i < n && at[i] <= o; i++) {
+			if (d[i] == 1 && ch == '\n')
+				lines_push(at[i] + delta);
+			delta += d[i];
+		}
+		if (o == INT_MAX)
+			break;
+
+		--nright;
+		if (i == n || d[i] != -1 || o != at[i] - 1)
+			lines[nleft++] = o + delta;
+	}
+#endif
+
+	for (i = 0, delta = 0; i < n; i++) {
+		delta += d[i];
+		at[i] += delta;
+	}
+
+	idx = at[primary];
+	for (i = ncursors = 0; i < n; i++) {
+		if (at[i] != idx && (ncursors == 0 ||
+		    cursors[ncursors - 1] != at[i]))
+			cursors[ncursors++] = at[i];
+	}
+}
+
+/*
+ * Add a cursor at offset, keeping them in order.
+ */
+static int
+cursor_add(int offset)
+{
+	int i;
+
+	for (i = ncursors; 0 < i && offset < cursors[i - 1]; i--)
+		;
+	if (offset == idx || (0 < i && cursors[i - 1] == offset))
+		return 0;
+
+	if (ncursors == CURSOR_MAX)
+		return -1;
+
+	memmove(cursors + i + 1, cursors + i, (ncursors - i) * sizeof(int));
+	cursors[i] = offset;
+	++ncursors;
+
+	return 0;
+}
+
+/*
+ * Bulk rewrites.  With the gap at the start of the text to change,
+ * the old text is read at egap and the new text written at gap,
+ * in one pass.  The line index and newline count follow each
+ * byte; words are recounted over the span at the end.
+ */
+static int rw_lo, rw_hi, rw_in, rw_out;
+static struct undo *rw_undo;
+
+/*
+ * Marks in the span follow the old text they are in when it is
+ * kept, or written out again from where it is, and go to where
+ * the writing has got to when it is dropped.  Fold ends are not
+ * moved out of order.  rw_mark holds them, from rw_slot on.
+ */
+static struct carry {
+	int from, to;
+	char name;
+} rw_mark[MARK_MAX];
+static int rw_slot, rw_nmark;
+
+/*
+ * The old text from offset from up to end now starts at to, or
+ * is gone if how is 0.  How is 2 if it was written out of order.
+ */
+static void
+rw_carry(int from, int end, int to, int how)
+{
+	int i, lo = 0, hi = rw_nmark, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rw_mark[mid].from < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < rw_nmark && rw_mark[i].from < end; i++) {
+		if (rw_mark[i].to != -1 || (how == 2 &&
+		    (rw_mark[i].name == '{' || rw_mark[i].name == '}')))
+			continue;
+		rw_mark[i].to = (how == 0) ? to : to + rw_mark[i].from - from;
+	}
+}
+
+static int
+rw_cmp(const void *a, const void *b)
+{
+	const struct carry *x = a, *y = b;
+
+	return (x->to != y->to) ? x->to - y->to : x->from - y->from;
+}
+
+static void
+rw_begin(int lo, int hi)
+{
+	int k;
+
+	idx = lo;
+	movegap();
+#ifdef __unix__
+	if (pinned != NULL)
+		snap_detach();
+#endif
+
+	nwords -= starts(lo, hi + 1);
+	rw_undo = undo_push(lo, egap, hi - lo);
+	rw_lo = lo;
+	rw_hi = hi;
+	rw_in = rw_out = 0;
+	ncursors = 0;
+
+	rw_slot = mark_find(lo) + 1;
+	for (rw_nmark = 0; rw_slot + rw_nmark <= nmarks &&
+	    (k = mark_pos(rw_slot + rw_nmark)) <= hi; rw_nmark++) {
+		rw_mark[rw_nmark].from = k;
+		rw_mark[rw_nmark].to = -1;
+		rw_mark[rw_nmark].name = markname[rw_slot + rw_nmark];
+	}
+}
+
+/*
+ * Make room to write n bytes.
+ */
+static int
+rw_room(int n)
+{
+
+#ifdef __unix__
+	if (egap - gap < n)
+		growbuf(n);
+#endif
+
+	return (egap - gap < n) ? -1 : 0;
+}
+
+/*
+ * Write n new bytes.  s must not point into the buffer unless
+ * rw_room() made space for them first.
+ */
+static int
+rw_write(const char *s, int n)
+{
+	int i;
+
+	if (rw_room(n) == -1)
+		return -1;
+
+	if (egap <= s && s < egap + (rw_hi - rw_lo - rw_in))
+		rw_carry(rw_lo + rw_in + (s - egap),
+		    rw_lo + rw_in + (s - egap) + n + 1, rw_lo + rw_out, 2);
+	if (n == 0)
+		return 0;
+#ifdef __unix__
+	page_touch(n);
+#endif
+	memcpy(gap, s, n);
+	for (i = 0; i < n; i++) {
+		if (gap[i] == '\n') {
+#ifdef __unix__
+			lines_push(rw_lo + rw_out + i);
+#endif
+			++nlf;
+		}
+	}
+	gap += n;
+	rw_out += n;
+
+	return 0;
+}
+
+static int
+rw_fill(int ch, int n)
+{
+	char pad[16];
+	int k;
+
+	memset(pad, ch, sizeof(pad));
+	for (; 0 < n; n -= k) {
+		k = (n < sizeof(pad)) ? n : sizeof(pad);
+		if (rw_write(pad, k) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop n old bytes.
+ */
+static void
+rw_skip(int n)
+{
+	int i;
+
+	rw_carry(rw_lo + rw_in, rw_lo + rw_in + n, rw_lo + rw_out, 0);
+	for (i = 0; i < n; i++) {
+		if (egap[i] == '\n') {
+#ifdef __unix__
+			--nright;
+#endif
+			--nlf;
+		}
+	}
+	egap += n;
+	rw_in += n;
+}
+
+/*
+ * Keep n old bytes.
+ */
+static int
+rw_copy(int n)
+{
+	size_t k;
+	int i, j;
+
+	if (rw_room(0) == -1)
+		return -1;
+
+	rw_carry(rw_lo + rw_in, rw_lo + rw_in + n, rw_lo + rw_out, 1);
+	for (i = 0; i < n; i += k) {
+#ifdef __unix__
+		k = page_step(n - i);
+#else
+		k = n - i;
+#endif
+		memmove(gap + i, egap + i, k);
+#ifdef __unix__
+		for (j = i; j < i + k; j++) {
+			if (gap[j] == '\n') {
+				--nright;
+				lines_push(rw_lo + rw_out + j);
+			}
+		}
+#endif
+	}
+	gap += n;
+	egap += n;
+	rw_in += n;
+	rw_out += n;
+
+	return 0;
+}
+
+/*
+ * Returns the length of the new text.  If nothing was rewritten,
+ * as when there was no room, nothing else changes either.
+ */
+static int
+rw_end(void)
+{
+	int delta, i, n;
+
+	n = rw_out + (rw_hi - rw_lo - rw_in);
+	nwords += starts(rw_lo, rw_lo + n + 1);
+	idx = rw_lo;
+
+	if (rw_in == 0 && rw_out == 0) {
+		if (rw_undo != NULL) {
+			ulen -= rw_undo->size ? rw_undo->size : rw_undo->len;
+			--nundo;
+		}
+		return n;
+	}
+
+	if (rw_undo != NULL)
+		rw_undo->n = n;
+
+	rw_carry(rw_lo + rw_in, rw_hi + 1, rw_lo + rw_out, 1);
+	delta = n - (rw_hi - rw_lo);
+	if (rw_nmark == 0) {
+		mark_add(rw_slot, delta);
+	} else {
+		qsort(rw_mark, rw_nmark, sizeof(rw_mark[0]), rw_cmp);
+		mark_unpack();
+		for (i = 0; i < rw_nmark; i++) {
+			marktree[rw_slot + i] = rw_mark[i].to;
+			markname[rw_slot + i] = rw_mark[i].name;
+		}
+		for (i = rw_slot + rw_nmark; i <= nmarks; i++)
+			marktree[i] += delta;
+		mark_pack();
+	}
+
+	++version;
+	dirty = 1;
+
+	return n;
+}
+
+static int
+hexval(int ch)
+{
+
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+
+	return -1;
+}
+
+/*
+ * Hex digits overwrite the nibble under the cursor in place;
+ * only appending at the end of the buffer goes through insert().
+ */
+static void
+hex_insert(int ch)
+{
+	char *p;
+	int v;
+
+	if (ch == '\b' || ch == '\177') {
+		nibble = 0;
+		insert(ch);
+		return;
+	}
+
+	if ((v = hexval(ch)) == -1)
+		return;
+
+	dirty = 1;
+
+	if (idx == pos(ebuf)) {
+		insert(v << 4);
+		--idx;
+		nibble = 1;
+		return;
+	}
+
+	p = ptr(idx);
+	ch = (nibble == 0) ? (*p & 0x0f) | (v << 4) : (*p & 0xf0) | v;
+
+	/*
+	 * Newlines are indexed at the gap, so only
+	 * they make the gap come to the cursor.
+	 */
+	if (*p == '\n' || ch == '\n') {
+		movegap();
+		p = egap;
+	}
+
+	count(idx, -1);
+#ifdef __unix__
+	if (*p == '\n')
+		--nright;
+	snap_write(p);
+#endif
+	undo_typed(idx, p, 1);
+	*p = ch;
+#ifdef __unix__
+	if (*p == '\n') {
+		lines_grow();
+		lines[lcap - ++nright] = pos(ebuf) - idx;
+	}
+#endif
+	count(idx, 1);
+
+	if (nibble == 0) {
+		nibble = 1;
+	} else {
+		nibble = 0;
+		++idx;
+	}
+}
+
+static void
+toggle_hex(void)
+{
+
+	hexmode = !hexmode;
+	nibble = ncursors = 0;
+
+	page = prevline(idx);
+	epage = idx + 1;
+}
+
+static unsigned int
+get_linecolno(void)
+{
+
+	line = line_of(idx);
+
+	return idx - line_start(line);
+}
+
+static void
+update_modeline(unsigned int colno)
+{
+	unsigned int i;
+	unsigned long rest;
+#ifdef __unix__
+	char unit;
+#endif
+
+	for (i = 0; i < sizeof(modeline); i++)
+		modeline[i] = '\0';
+
+	i = strdcpy(modeline, "VCE: ");
+
+	if (filename[0] != '\0')
+		i += strdcat(modeline, filename, COL_MAX > 21 ? 16 : 11);
+
+	if (COL_MAX > 34) {
+		while (i < 21)
+			i += strdcat(modeline, " ", 1);
+		i += strdcat(modeline, "L: ", 3);
+		i += strdcat(modeline, putn(line), strlen(putn(line)));
+
+		if (COL_MAX > 48) {
+			while (i < 35)
+				i += strdcat(modeline, " ", 1);
+			i += strdcat(modeline, "C: ", 3);
+			i += strdcat(modeline, putn(colno), strlen(putn(colno)));
+
+			if (ncursors > 0) {
+				i += strdcat(modeline, " +", 2);
+				i += strdcat(modeline, putn(ncursors),
+				    strlen(putn(ncursors)));
+			}
+
+			if (COL_MAX > 64) {
+				while (i < COL_MAX - 13)
+					i += strdcat(modeline, " ", 1);
+
+#if defined(__cpm__) || defined(__msdos__)
+				i += strdcat(modeline, "  ", 2);
+#endif
+
+				i += strdcat(modeline, "Rest: ", 6);
+
+#ifdef __unix__
+				rest = buflimit() - (ebuf - egap) - (gap - buf);
+
+				/*
+				 * Large limits are shown in megabytes.
+				 */
+				unit = '\0';
+				if (rest > 9999999) {
+					rest >>= 20;
+					unit = 'M';
+				}
+
+				if (rest < 1000000 && unit == '\0')
+					i += strdcat(modeline, " ", 1);
+				if (rest < 100000)
+					i += strdcat(modeline, " ", 1);
+#else
+				rest = BUF - (ebuf - egap) - (gap - buf);
+#endif
+
+				if (rest < 10000)
+					i += strdcat(modeline, " ", 1);
+				if (rest < 1000)
+					i += strdcat(modeline, " ", 1);
+				if (rest < 100)
+					i += strdcat(modeline, " ", 1);
+				if (rest < 10)
+					i += strdcat(modeline, " ", 1);
+				i += strdcat(modeline, putn(rest),
+					strlen(putn(rest)));
+
+#ifdef __unix__
+				if (unit != '\0')
+					i += strdcat(modeline, &unit, 1);
+#endif
+			}
+		}
+	}
+
+	while (i < COL_MAX)
+		i += strdcat(modeline, " ", 1);
+}
+
+/*
+ * Number row i of the gutter.
+ */
+static void
+number(int i, unsigned int n)
+{
+	char *s = putn(n);
+	int len = strlen(s);
+
+	memcpy(&screen[i][gutter - 1 - len], s, len);
+}
+
+/*
+ * Laid out rows, keyed by where they start in the text.  An edit
+ * changes the version, which retires every entry at once.
+ */
+static struct {
+	int start, end, last, gutter;
+	unsigned long version, used;
+	char image[COL_MAX];
+} rows[ROW_CACHE];
+static unsigned long rowtick;
+
+/*
+ * Lay out row i from epage, leaving epage at the start of the
+ * next row.  Returns 1 if the row ends its line, -1 if it ends
+ * the buffer.
+ */
+static int
+lay_row(int i, int first, unsigned int n)
+{
+	char *p;
+	int j = gutter, k;
+
+	if (first && gutter)
+		number(i, n);
+
+	while (1) {
+		if (idx == epage) {
+			row = i;
+			col = j - gutter;
+		}
+		p = ptr(epage);
+		if (ebuf <= p)
+			return -1;
+		if (*p != '\r') {
+			if (*p == '\n') {
+				screen[i][j++] = ' ';
+			} else if (*p == '\t') {
+				k = 8 - ((j - gutter) & 7);
+				while (k-- && j < COL_MAX)
+					screen[i][j++] = ' ';
+			} else {
+				screen[i][j++] = *p;
+			}
+		}
+		++epage;
+		if (*p == '\n')
+			return 1;
+		if (COL_MAX <= j)
+			return 0;
+	}
+}
+
+/*
+ * Check in one pass that a row is plain printable ASCII.
+ */
+static int
+printable(const char *s, int n)
+{
+	unsigned char bad = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		bad |= ((unsigned char) (s[i] - ' ') > '~' - ' ');
+
+	return !bad;
+}
+
+/*
+ * Show row i straight from the buffer if it holds nothing
+ * but printable ASCII.  Returns -2 if it must be laid out.
+ */
+static int
+direct_row(int i)
+{
+	char *nl, *p[2];
+	int k, last, len, n[2], used, vis;
+
+	len = pos(ebuf) - epage;
+	vis = (len < COL_MAX) ? len : COL_MAX;
+
+	p[0] = ptr(epage);
+	if (p[0] < gap) {
+		n[0] = (gap - p[0] < vis) ? gap - p[0] : vis;
+		p[1] = egap;
+	} else {
+		n[0] = vis;
+		p[1] = ebuf;
+	}
+	n[1] = vis - n[0];
+
+	last = (len < COL_MAX) ? -1 : 0;
+	for (k = 0, used = 0; k < 2; used += n[k++]) {
+		if ((nl = memchr(p[k], '\n', n[k])) != NULL) {
+			vis = used + (nl - p[k]);
+			n[k] = nl - p[k];
+			if (k == 0)
+				n[1] = 0;
+			last = 1;
+			break;
+		}
+	}
+
+	if (vis == 0 || !printable(p[0], n[0]) || !printable(p[1], n[1]))
+		return -2;
+
+	used = vis + (last == 1);
+	if (epage <= idx && (idx < epage + used ||
+	    (idx == epage + used && last == -1))) {
+		row = i;
+		col = idx - epage;
+	}
+
+	drow[i].p[0] = p[0];
+	drow[i].p[1] = p[1];
+	drow[i].n[0] = n[0];
+	drow[i].n[1] = n[1];
+	epage += used;
+
+	return last;
+}
+
+/*
+ * Copy row i from the cache if it was laid out before, unless
+ * the cursor is on it.  Returns -2 on a miss.
+ */
+static int
+cached_row(int i)
+{
+	int k;
+
+	for (k = 0; k < ROW_CACHE; k++) {
+		if (rows[k].start == epage && rows[k].version == version &&
+		    rows[k].gutter == gutter && rows[k].used != 0)
+			break;
+	}
+
+	if (k == ROW_CACHE)
+		return -2;
+
+	if (rows[k].start <= idx && (idx < rows[k].end ||
+	    (idx == rows[k].end && rows[k].last == -1)))
+		return -2;
+
+	memcpy(screen[i], rows[k].image, COL_MAX);
+	rows[k].used = ++rowtick;
+	epage = rows[k].end;
+
+	return rows[k].last;
+}
+
+static void
+cache_row(int i, int start, int last)
+{
+	int k, old = 0;
+
+	for (k = 1; k < ROW_CACHE; k++) {
+		if (rows[k].used < rows[old].used)
+			old = k;
+	}
+
+	rows[old].start = start;
+	rows[old].end = epage;
+	rows[old].last = last;
+	rows[old].gutter = gutter;
+	rows[old].version = version;
+	rows[old].used = ++rowtick;
+	memcpy(rows[old].image, screen[i], COL_MAX);
+}
+
+/*
+ * Show that row i heads a fold.
+ */
+static void
+fold_row(int i)
+{
+	int j;
+
+	if (drow[i].n[0] + drow[i].n[1] > 0) {
+		memcpy(screen[i], drow[i].p[0], drow[i].n[0]);
+		memcpy(screen[i] + drow[i].n[0], drow[i].p[1], drow[i].n[1]);
+		drow[i].n[0] = drow[i].n[1] = 0;
+	}
+
+	for (j = COL_MAX; gutter < j && screen[i][j - 1] == ' '; j--)
+		;
+	if (COL_MAX - 4 < j)
+		j = COL_MAX - 4;
+	memcpy(&screen[i][j], " ...", 4);
+}
+
+/*
+ * The gutter starts from the line index once per frame and
+ * counts newlines from there as rows are laid out.  A row that
+ * ends where a fold starts is followed by the line after it.
+ */
+static void
+layout(void)
+{
+	int i, first, k, last, start;
+	unsigned int n = 0;
+
+	if ((k = fold_find(idx)) != 0)
+		fold_del(k);
+
+	if (idx < page)
+		page = prevline(idx);
+
+	if (epage <= idx) {
+		page = nextline(idx);
+		i = ((page == pos(ebuf)) ? ROW_MAX - 3 : ROW_MAX - 1);
+		while (0 < i--)
+			page = prevline(fold_out(page - 1, -1));
+	}
+
+	gutter = 0;
+	if (numbers) {
+		for (gutter = 2, n = nlf + 1; 10 <= n; n /= 10)
+			++gutter;
+		if (COL_MAX / 2 < gutter)
+			gutter = 0;
+	}
+
+	epage = page;
+	first = 1;
+
+	if (gutter)
+		n = line_of(page);
+
+	for (i = 0; i < ROW_MAX - 1; i++) {
+		last = (gutter == 0) ? direct_row(i) : -2;
+		if (last == -2 && (last = cached_row(i)) == -2) {
+			start = epage;
+			last = lay_row(i, first, n);
+			cache_row(i, start, last);
+		}
+		if (last == -1) {
+			/*
+			 * The text ends on screen, so nothing past it is
+			 * hidden; the next layout keeps this page.
+			 */
+			epage = pos(ebuf) + 1;
+			return;
+		}
+		if (last == 1 && (k = fold_out(epage, 1)) != epage) {
+			fold_row(i);
+			if (gutter)
+				n += line_of(k) - line_of(epage);
+			epage = k;
+		}
+		if ((first = last) == 1)
+			++n;
+	}
+
+	/*
+	 * Wrapped rows can fill the frame with the cursor just past
+	 * it, below the last row; scroll a line and lay out again, or
+	 * if its own line fills the frame, keep it on the last row.
+	 */
+	if (idx == epage && page < prevline(idx)) {
+		page = fold_out(nextline(page), 1);
+		epage = idx + 1;
+		layout();
+	} else if (idx == epage) {
+		row = i - 1;
+		col = COL_MAX - 1 - gutter;
+	}
+}
+
+/*
+ * Hex rows map straight to offsets, so no newline is ever scanned.
+ */
+static void
+hex_layout(void)
+{
+	static const char hexdig[] = "0123456789ABCDEF";
+	unsigned char ch;
+	int i, j, k, end = pos(ebuf);
+
+	page -= page % HEX_W;
+	if (idx < page)
+		page = idx - idx % HEX_W;
+	if (page + (ROW_MAX - 1) * HEX_W <= idx)
+		page = (idx / HEX_W - (ROW_MAX - 2)) * HEX_W;
+	epage = page + (ROW_MAX - 1) * HEX_W;
+
+	for (i = 0; i < ROW_MAX - 1; i++) {
+		if ((k = page + i * HEX_W) > end || (k == end && idx != end))
+			break;
+
+		for (j = 0; j < 8; j++)
+			screen[i][j] = hexdig[(k >> (28 - j * 4)) & 15];
+
+		for (j = 0; j < HEX_W && k + j < end; j++) {
+			ch = *ptr(k + j);
+			screen[i][10 + j * 3] = hexdig[ch >> 4];
+			screen[i][11 + j * 3] = hexdig[ch & 15];
+			screen[i][11 + HEX_W * 3 + j] =
+			    (ch >= ' ' && ch <= '~') ? ch : '.';
+		}
+	}
+
+	row = (idx - page) / HEX_W;
+	col = 10 + (idx % HEX_W) * 3 + nibble;
+	gutter = 0;
+}
+
+static int
+modecat(int i, const char *str)
+{
+	int n = strlen(str);
+
+	if (COL_MAX - i < n)
+		n = COL_MAX - i;
+
+	return (n > 0) ? i + strdcat(modeline, str, n) : i;
+}
+
+static void
+sel_count(int from, int to, int sign)
+{
+	int ch;
+
+	for (; from < to; from++) {
+		ch = byteat(from);
+		if (ch == '\n')
+			sellf += sign;
+		if (isword(ch) && !isword(byteat(from - 1)))
+			selwords += sign;
+	}
+}
+
+/*
+ * Selection counts follow the region as its ends move, scanning
+ * only the bytes they passed over.  Typing and deleting are carried
+ * by sel_edit(); bulk rewrites force a recount.
+ */
+static void
+sel_update(int lo, int hi)
+{
+
+	if (!selok || selversion != version || hi < sello || selhi < lo) {
+		sellf = selwords = 0;
+		sel_count(lo, hi, 1);
+	} else {
+		if (lo < sello)
+			sel_count(lo, sello, 1);
+		else
+			sel_count(sello, lo, -1);
+
+		if (selhi < hi)
+			sel_count(selhi, hi, 1);
+		else
+			sel_count(hi, selhi, -1);
+	}
+
+	sello = lo;
+	selhi = hi;
+	selversion = version;
+	selok = 1;
+}
+
+/*
+ * Lines, words and bytes, like wc(1), for the buffer
+ * and for the region between the mark and the cursor.
+ */
+static void
+update_statline(void)
+{
+	int i, lo, hi, slot;
+	long w;
+
+	for (i = 0; i < COL_MAX; i++)
+		modeline[i] = '\0';
+
+	i = strdcpy(modeline, "VCE: ");
+
+	if (filename[0] != '\0')
+		i += strdcat(modeline, filename, COL_MAX > 21 ? 16 : 11);
+
+	while (i < 21 && i < COL_MAX)
+		i += strdcat(modeline, " ", 1);
+
+	i = modecat(i, "wc: ");
+	i = modecat(i, putn(nlf));
+	i = modecat(i, " ");
+	i = modecat(i, putn(nwords));
+	i = modecat(i, " ");
+	i = modecat(i, putn(pos(ebuf)));
+
+	if ((slot = mark_get('.')) != 0) {
+		lo = mark_pos(slot);
+		hi = idx;
+		if (hi < lo) {
+			hi = lo;
+			lo = idx;
+		}
+		sel_update(lo, hi);
+
+		w = selwords;
+		if (lo < hi && isword(byteat(lo)) && isword(byteat(lo - 1)))
+			++w;
+
+		i = modecat(i, "  sel: ");
+		i = modecat(i, putn(sellf));
+		i = modecat(i, " ");
+		i = modecat(i, putn(w));
+		i = modecat(i, " ");
+		i = modecat(i, putn(hi - lo));
+	}
+
+	while (i < COL_MAX)
+		i += strdcat(modeline, " ", 1);
+}
+
+static void
+update_display(void)
+{
+	int i, j;
+
+	for (i = 0; i < ROW_MAX - 1; i++) {
+		for (j = 0; j < COL_MAX; j++)
+			screen[i][j] = ' ';
+		drow[i].n[0] = drow[i].n[1] = 0;
+	}
+
+	if (hexmode)
+		hex_layout();
+	else
+		layout();
+
+	if (statmode) {
+		update_statline();
+	} else if (hexmode) {
+		line = idx / HEX_W + 1;
+		update_modeline(idx % HEX_W);
+	} else {
+		update_modeline(get_linecolno());
+	}
+
+	if (note[0] != '\0') {
+		for (i = 0; i < COL_MAX; i++)
+			modeline[i] = '\0';
+
+		i = strdcpy(modeline, "VCE: ");
+		i += strdcat(modeline, note, strlen(note));
+		while (i < COL_MAX)
+			i += strdcat(modeline, " ", 1);
+	}
+
+#ifdef ANSI
+	present();
+#endif
+}
+
+#ifdef __unix__
+/*
+ * Directory listings for completion, sorted and kept until the
+ * directory's mtime changes.
+ */
+static struct {
+	char path[COL_MAX - 5];
+	time_t mtime;
+	unsigned long used;
+	char *pool, **names;
+	int n;
+} dirs[DIR_CACHE];
+static unsigned long dirtick;
+
+static int
+namecmp(const void *a, const void *b)
+{
+
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Returns the slot listing path, or -1.
+ */
+static int
+dir_list(const char *path)
+{
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	char *p, *pool = NULL;
+	size_t cap = 0, len, used = 0;
+	int i, n = 0, slot = 0;
+
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return -1;
+
+	for (i = 0; i < DIR_CACHE; i++) {
+		if (dirs[i].pool != NULL && strcmp(dirs[i].path, path) == 0)
+			break;
+		if (dirs[i].used < dirs[slot].used)
+			slot = i;
+	}
+	if (i < DIR_CACHE) {
+		slot = i;
+		if (dirs[slot].mtime == st.st_mtime) {
+			dirs[slot].used = ++dirtick;
+			return slot;
+		}
+	}
+
+	if ((d = opendir(path)) == NULL)
+		return -1;
+
+	while ((e = readdir(d)) != NULL) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+
+		len = strlen(e->d_name) + 1;
+		if (cap < used + len) {
+			cap = (cap + len) * 2;
+			if ((p = realloc(pool, cap)) == NULL)
+				break;
+			pool = p;
+		}
+		memcpy(pool + used, e->d_name, len);
+		used += len;
+		++n;
+	}
+	closedir(d);
+
+	free(dirs[slot].pool);
+	free(dirs[slot].names);
+	dirs[slot].pool = NULL;
+	dirs[slot].names = NULL;
+	dirs[slot].used = 0;
+
+	if (pool == NULL) {
+		if ((pool = malloc(1)) == NULL)
+			return -1;
+		n = 0;
+	}
+
+	if ((dirs[slot].names = malloc((n + 1) * sizeof(char *))) == NULL) {
+		free(pool);
+		return -1;
+	}
+	for (i = 0, p = pool; i < n; i++, p += strlen(p) + 1)
+		dirs[slot].names[i] = p;
+	qsort(dirs[slot].names, n, sizeof(char *), namecmp);
+
+	strdcpy(dirs[slot].path, path);
+	dirs[slot].mtime = st.st_mtime;
+	dirs[slot].used = ++dirtick;
+	dirs[slot].pool = pool;
+	dirs[slot].n = n;
+
+	return slot;
+}
+
+/*
+ * Extend the path in s as far as the names in its directory
+ * agree, and add a slash once it names a single directory.
+ */
+static int
+complete(char *s, int j, int max)
+{
+	struct stat st;
+	char dir[COL_MAX - 5], **v;
+	const char *base;
+	int blen, first, hi, lo, mid, n, slot;
+
+	if ((base = strrchr(s, '/')) == NULL) {
+		strdcpy(dir, ".");
+		base = s;
+	} else {
+		++base;
+		memcpy(dir, s, base - s);
+		dir[base - s] = '\0';
+	}
+
+	if ((slot = dir_list(dir)) == -1)
+		return j;
+
+	v = dirs[slot].names;
+	n = dirs[slot].n;
+	blen = strlen(base);
+
+	for (lo = 0, hi = n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (strcmp(v[mid], base) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	for (hi = n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (strncmp(v[mid], base, blen) == 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	lo = first;
+	if (lo == hi)
+		return j;
+
+	for (n = blen; j < max && v[lo][n] != '\0' &&
+	    v[lo][n] == v[hi - 1][n]; n++)
+		s[j++] = v[lo][n];
+	s[j] = '\0';
+
+	if (hi - lo == 1 && v[lo][n] == '\0' && j < max &&
+	    stat(s, &st) == 0 && S_ISDIR(st.st_mode)) {
+		s[j++] = '/';
+		s[j] = '\0';
+	}
+
+	return j;
+}
+#endif
+
+/*
+ * Draw the prompt line; only what changed goes out.
+ */
+static void
+show_prompt(const char *label, int j)
+{
+	int i, w;
+
+	for (i = 0; i < COL_MAX; i++)
+		modeline[i] = '\0';
+
+	i = strdcpy(modeline, label);
+	w = COL_MAX - i - 1;
+	if (w < j)
+		i += strdcat(modeline, response + j - w, w);
+	else
+		i += strdcat(modeline, response, j);
+	while (i < COL_MAX)
+		i += strdcat(modeline, " ", 1);
+
+#ifdef ANSI
+	put_row(0, modeline, shadow[0], 1);
+	cup(0, strlen(label) + ((w < j) ? w : j));
+	flush();
+#endif
+}
+
+/*
+ * Read a line of input for prompt pr.  Up and down step through
+ * earlier answers, Tab completes a file name, Esc gives up.
+ * Other control sequences are read whole and dropped.
+ * If each is given, it sees the answer after every key.
+ */
+static char *
+get_response(int pr, void (*each)(const char *))
+{
+	char draft[sizeof(response)];
+	int ch, h, i, j = 0;
+
+	for (i = 0; i < sizeof(response); i++)
+		response[i] = '\0';
+
+	h = nhist[pr];
+
+	while (1) {
+		if (each != NULL)
+			each(response);
+		show_prompt(prompts[pr], j);
+
+		if ((ch = fgetc(stdin)) == '\n' || ch == '\r')
+			break;
+
+		if (ch == '\033') {
+			ch = fgetc(stdin);
+#if defined(ANSI) && !defined(__msdos__)
+			if (ch != '[')
+				return NULL;
+			ch = fgetc(stdin);
+#ifdef __unix__
+			if (ch == '?') {
+				sync_reply();
+				continue;
+			}
+#endif
+			/* Parameters run up to the final byte. */
+			while (0x20 <= ch && ch < 0x40)
+				ch = fgetc(stdin);
+			if (ch == 'A')
+				ch = '\005';
+			else if (ch == 'B')
+				ch = '\030';
+			else
+				continue;
+#else
+			return NULL;
+#endif
+		}
+
+		if (ch == '\005' || ch == '\030') {
+			/* ^E and ^X */
+			if (h == nhist[pr])
+				memcpy(draft, response, sizeof(draft));
+			if (ch == '\005' && 0 < h)
+				--h;
+			else if (ch == '\030' && h < nhist[pr])
+				++h;
+			else
+				continue;
+			memcpy(response, (h < nhist[pr]) ? hist[pr][h] : draft,
+			    sizeof(response));
+			j = strlen(response);
+		} else if (ch == '\b' || ch == '\177') {
+			if (0 < j)
+				response[--j] = '\0';
+#ifdef __unix__
+		} else if (ch == '\t') {
+			if (pr == PR_FILE)
+				j = complete(response, j, sizeof(response) - 1);
+#endif
+		} else if (' ' <= ch && ch <= '~' && j < sizeof(response) - 1) {
+			response[j++] = ch;
+		}
+	}
+
+	if (j == 0)
+		return NULL;
+
+	if (nhist[pr] == 0 || strcmp(hist[pr][nhist[pr] - 1], response)) {
+		if (nhist[pr] == HIST_MAX)
+			memmove(hist[pr][0], hist[pr][1],
+			    sizeof(hist[pr]) - sizeof(hist[pr][0]));
+		else
+			++nhist[pr];
+		memcpy(hist[pr][nhist[pr] - 1], response, sizeof(response));
+	}
+
+	return response;
+}
+
+/*
+ * Post a message for the modeline.  It stays up until the next
+ * key, or on Unix until NOTE_WAIT passes without one.
+ */
+static void
+message(const char *msg)
+{
+	int i;
+
+	for (i = 0; i < sizeof(note) - 1 && msg[i] != '\0'; i++)
+		note[i] = msg[i];
+	note[i] = '\0';
+}
+
+#ifdef __unix__
+/*
+ * Saves run in the background.  The thread writes one byte to
+ * the job pipe when done, and getkey() reports it.
+ */
+static struct snap *save_snap;
+static unsigned long save_version;
+static int jobfd[2] = { -1, -1 }, save_fd, saving;
+
+static void
+job_done(void)
+{
+	char r;
+
+	if (read(jobfd[0], &r, 1) != 1)
+		return;
+
+	saving = 0;
+	if (r == 'o') {
+		if (version == save_version)
+			dirty = 0;
+		message("save ok");
+	} else {
+		message("failed write");
+	}
+}
+#endif
+
+/*
+ * Wait for a key, retrying a dropped frame whenever the
+ * terminal catches up before the key arrives, taking down
+ * a message that has been up long enough, and reporting
+ * background saves as they finish.
+ */
+static int
+getkey(void)
+{
+#if defined(__unix__) && defined(ANSI)
+	struct pollfd pfd[2];
+	int n, wait;
+
+	pfd[0].fd = 0;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+
+	while (stale || note[0] != '\0' || saving) {
+		wait = stale ? FRAME_WAIT : (note[0] != '\0') ? NOTE_WAIT : -1;
+		pfd[1].fd = saving ? jobfd[0] : -1;
+
+		if ((n = poll(pfd, 2, wait)) == -1)
+			break;
+
+		if (0 < n && (pfd[1].revents & POLLIN)) {
+			job_done();
+			update_display();
+		} else if (0 < n) {
+			break;
+		} else if (stale) {
+			present();
+		} else {
+			note[0] = '\0';
+			update_display();
+		}
+	}
+#endif
+
+	note[0] = '\0';
+
+	return fgetc(stdin);
+}
+
+#ifdef __unix__
+/*
+ * Write out save_snap.  arg is set when it runs in the
+ * foreground, where a paged buffer lets go of pages as it goes.
+ */
+static void *
+save_worker(void *arg)
+{
+	static char block[SNAP_BLOCK];
+	size_t off = 0;
+	long n;
+	char r;
+
+	while (0 < (n = snap_read(save_snap, off, block, sizeof(block)))) {
+		if (write(save_fd, block, n) != n) {
+			n = -1;
+			break;
+		}
+		off += n;
+		if (arg != NULL)
+			page_touch(n);
+	}
+	r = (n == 0 && close(save_fd) == 0) ? 'o' : 'f';
+	if (n != 0)
+		close(save_fd);
+	snap_release(save_snap);
+
+	write(jobfd[1], &r, 1);
+
+	return NULL;
+}
+#endif
+
+/*
+ * On Unix the file is written from a snapshot by another thread,
+ * so editing goes on during the save.
+ */
+static void
+save_file(void)
+{
+	int fd, i;
+#if defined(__unix__)
+	pthread_t tid;
+#else
+	char *bp;
+	int saveidx = idx;
+#endif
+
+	if (filename[0] == '\0') {
+		if (get_response(PR_FILE, NULL) == NULL) {
+			message("no filename");
+			return;
+		}
+
+		for (i = 0; response[i] != '\0'; i++)
+			filename[i] = response[i];
+	}
+
+#ifdef __unix__
+	if (saving) {
+		message("still saving");
+		return;
+	}
+	if (jobfd[0] == -1 && pipe(jobfd) == -1) {
+		message("failed save");
+		return;
+	}
+#endif
+
+	if ((fd = open(filename, MFLAGS, 0644)) == -1) {
+		message("failed open");
+		return;
+	}
+
+#ifdef __unix__
+	if ((save_snap = snap_take()) == NULL) {
+		close(fd);
+		message("failed save");
+		return;
+	}
+	save_fd = fd;
+	save_version = version;
+	saving = 1;
+
+	/*
+	 * A paged buffer is written out before going on, since
+	 * editing it during the save would copy it into memory; a
+	 * packed one, since only this thread may unpack it.
+	 */
+	if (pagefd == -1 && coldmax == 0 &&
+	    pthread_create(&tid, NULL, save_worker, NULL) == 0)
+		pthread_detach(tid);
+	else
+		save_worker(&save_fd);
+#else
+	idx = 0;
+
+	movegap();
+
+#if defined(__msdos__)
+	write(fd, egap, ebuf - egap);
+#elif defined(__cpm__)
+	bp = egap;
+	while (*bp != EOF) {
+		if (bp == ebuf)
+			break;
+
+		if (*bp == '\0')
+			break;
+
+		if (*bp == '\n')
+			write(fd, "\r\n", 2);
+		else
+			write(fd, bp, 1);
+
+		++bp;
+	}
+#endif
+
+	close(fd);
+
+	idx = saveidx;
+
+	dirty = 0;
+
+	message("save ok");
+#endif
+}
+
+/*
+ * Search, shared by the buffer and by the search in files.  The
+ * skip table is Horspool's: how far the window may move when its
+ * last byte is c.  Where regexec() takes a length, an answer in
+ * slashes is an extended regular expression instead.  Neither
+ * kind of match spans lines.
+ */
+static struct {
+	unsigned char skip[256];
+	const char *s;
+	int len;
+#ifdef REG_STARTEND
+	regex_t re;
+	int isre;
+#endif
+} pat;
+
+/*
+ * -1 if s is not a valid expression.
+ */
+static int
+pat_init(const char *s)
+{
+	int i;
+#ifdef REG_STARTEND
+	char re[sizeof(response)];
+#endif
+
+	pat.s = s;
+	pat.len = strlen(s);
+
+#ifdef REG_STARTEND
+	if (pat.isre)
+		regfree(&pat.re);
+	pat.isre = 0;
+
+	if (2 < pat.len && s[0] == '/' && s[pat.len - 1] == '/') {
+		memcpy(re, s + 1, pat.len - 2);
+		re[pat.len - 2] = '\0';
+		if (regcomp(&pat.re, re, REG_EXTENDED | REG_NEWLINE) != 0)
+			return -1;
+		pat.isre = 1;
+		return 0;
+	}
+#endif
+
+	for (i = 0; i < 256; i++)
+		pat.skip[i] = pat.len;
+	for (i = 0; i < pat.len - 1; i++)
+		pat.skip[(unsigned char) s[i]] = pat.len - 1 - i;
+
+	return 0;
+}
+
+/*
+ * First match in s..e, or NULL; *end is set past it.  bol tells
+ * whether s starts a line.
+ */
+static const char *
+match(const char *s, const char *e, int bol, const char **end)
+{
+	unsigned char c;
+	int m = pat.len;
+#ifdef REG_STARTEND
+	regmatch_t rm;
+
+	if (pat.isre) {
+		rm.rm_so = 0;
+		rm.rm_eo = e - s;
+		if (regexec(&pat.re, s, 1, &rm,
+		    REG_STARTEND | (bol ? 0 : REG_NOTBOL)) != 0)
+			return NULL;
+		*end = s + rm.rm_eo;
+		return s + rm.rm_so;
+	}
+#endif
+
+	if (m == 0)
+		return NULL;
+
+	for (; m <= e - s; s += pat.skip[c]) {
+		c = s[m - 1];
+		if (c == (unsigned char) pat.s[m - 1] &&
+		    memcmp(s, pat.s, m - 1) == 0) {
+			*end = s + m;
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Empty the buffer and give it a new name.  The caller fills it
+ * and runs lines_build().
+ */
+static void
+new_buf(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(filename) - 1 && name[i] != '\0'; i++)
+		filename[i] = name[i];
+	filename[i] = '\0';
+
+#ifdef __unix__
+	if (pinned != NULL)
+		snap_detach();
+#endif
+	gap = buf;
+	egap = ebuf;
+
+	memset(marktree, 0, sizeof(marktree));
+	nmarks = nfolds = 0;
+
+	idx = page = epage = 0;
+	nibble = dirty = results = ncursors = 0;
+	undo_clear();
+}
+
+/*
+ * Replace the buffer with the file at path.  A file that cannot
+ * be read gives an empty buffer under its name.
+ */
+static void
+load_file(const char *path)
+{
+	int fd;
+#if defined(__unix__)
+	struct stat st;
+	ssize_t n;
+	size_t k;
+#elif defined(__cpm__)
+	char *bp;
+	int ch;
+#endif
+
+	new_buf(path);
+
+	if ((fd = open(filename, O_RDONLY)) != -1) {
+#if defined(__unix__)
+		if (fstat(fd, &st) == 0)
+			growbuf(st.st_size);
+
+		/*
+		 * A chunk at a time, so a paged or packed buffer keeps
+		 * to its limit while it fills.
+		 */
+		while (gap < egap) {
+			k = (egap - gap < COLD_CHUNK) ? egap - gap : COLD_CHUNK;
+#ifdef __linux__
+			cold_open(gap, k);
+#endif
+			if ((n = read(fd, gap, k)) <= 0)
+				break;
+			gap += n;
+			page_touch(n);
+#ifdef __linux__
+			cold_trim();
+#endif
+		}
+#elif defined(__msdos__)
+		gap += read(fd, buf, egap - gap);
+#elif defined(__cpm__)
+		bp = buf;
+		while (read(fd, &ch, 1) > 0) {
+			if (bp == ebuf)
+				break;
+
+			if (ch == EOF || ch == '\0')
+				break;
+
+			if (ch != '\r') {
+				*bp++ = ch;
+				++gap;
+			}
+		}
+#endif
+
+		if (gap < buf)
+			gap = buf;
+
+		close(fd);
+	}
+
+	lines_build();
+}
+
+#ifdef __unix__
+/*
+ * Every file under the current directory, for the finder.
+ * Names and directories live in one pool; each directory's
+ * mtime tells when the tree has to be walked again.  On Linux
+ * an inotify watch on each directory tells it instead.
+ */
+static struct {
+	char *pool;
+	size_t used, cap;
+	int *name, nfiles, fcap;
+	unsigned long *mask;
+	int *dir, ndirs, dcap;
+	time_t *mtime;
+} tree;
+static int found;
+
+/*
+ * The walk is shared by a few threads.  The directory list is
+ * their queue: tree_next is the next one to list, and tree_busy
+ * counts those being listed, which may still add more.
+ */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tree_cond = PTHREAD_COND_INITIALIZER;
+static int tree_next, tree_busy;
+#ifdef __linux__
+static int treefd = -1, treewatch;
+#endif
+
+/*
+ * One bit per letter, and six for the digits, so most names
+ * can be passed over without matching.
+ */
+static unsigned long
+charmask(const char *s)
+{
+	unsigned long m = 0;
+	int c;
+
+	for (; *s != '\0'; s++) {
+		c = tolower((unsigned char) *s);
+		if (c >= 'a' && c <= 'z')
+			m |= 1UL << (c - 'a');
+		else if (c >= '0' && c <= '9')
+			m |= 1UL << (26 + (c - '0') % 6);
+	}
+
+	return m;
+}
+
+static int
+tree_add(const char *s, size_t len)
+{
+	char *p;
+	size_t n;
+
+	if (tree.cap < tree.used + len + 1) {
+		n = (tree.cap == 0) ? 64 * 1024 : tree.cap;
+		while (n < tree.used + len + 1)
+			n *= 2;
+		if ((p = realloc(tree.pool, n)) == NULL)
+			return -1;
+		tree.pool = p;
+		tree.cap = n;
+	}
+
+	memcpy(tree.pool + tree.used, s, len);
+	tree.pool[tree.used + len] = '\0';
+	tree.used += len + 1;
+
+	return tree.used - len - 1;
+}
+
+static void
+tree_file(const char *path, size_t len)
+{
+	unsigned long *m;
+	int *p, n, off;
+
+	if (tree.nfiles == tree.fcap) {
+		n = (tree.fcap == 0) ? 1024 : tree.fcap * 2;
+		if ((p = realloc(tree.name, n * sizeof(int))) == NULL)
+			return;
+		tree.name = p;
+		if ((m = realloc(tree.mask, n * sizeof(long))) == NULL)
+			return;
+		tree.mask = m;
+		tree.fcap = n;
+	}
+
+	if ((off = tree_add(path, len)) == -1)
+		return;
+
+	tree.name[tree.nfiles++] = off;
+}
+
+static void
+tree_dir(const char *path, size_t len, time_t mtime)
+{
+	time_t *t;
+	int *p, n, off;
+
+	if (tree.ndirs == tree.dcap) {
+		n = (tree.dcap == 0) ? 256 : tree.dcap * 2;
+		if ((p = realloc(tree.dir, n * sizeof(int))) == NULL)
+			return;
+		tree.dir = p;
+		if ((t = realloc(tree.mtime, n * sizeof(time_t))) == NULL)
+			return;
+		tree.mtime = t;
+		tree.dcap = n;
+	}
+
+	if ((off = tree_add(path, len)) == -1)
+		return;
+
+	tree.dir[tree.ndirs] = off;
+	tree.mtime[tree.ndirs++] = mtime;
+}
+
+/*
+ * List the directory in path[0..len), leaving out hidden names
+ * and not following links to directories.  Directories found
+ * are queued for the walk.
+ */
+static void
+tree_list(char *path, size_t len)
+{
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	size_t n;
+
+#ifdef __linux__
+	if (inotify_add_watch(treefd, (len == 0) ? "." : path, IN_CREATE |
+	    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+	    IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW) == -1) {
+		pthread_mutex_lock(&tree_lock);
+		treewatch = 0;
+		pthread_mutex_unlock(&tree_lock);
+	}
+#endif
+
+	if ((d = opendir((len == 0) ? "." : path)) == NULL)
+		return;
+
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		n = strlen(e->d_name);
+		if (PATH_MAX - 1 <= len + n + 1)
+			continue;
+
+		memcpy(path + len, e->d_name, n + 1);
+		if (lstat(path, &st) == -1)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			path[len + n] = '/';
+			pthread_mutex_lock(&tree_lock);
+			tree_dir(path, len + n + 1, st.st_mtime);
+			pthread_mutex_unlock(&tree_lock);
+			pthread_cond_signal(&tree_cond);
+		} else if (S_ISREG(st.st_mode) ||
+		    (S_ISLNK(st.st_mode) && stat(path, &st) == 0 &&
+		    S_ISREG(st.st_mode))) {
+			pthread_mutex_lock(&tree_lock);
+			tree_file(path, len + n);
+			pthread_mutex_unlock(&tree_lock);
+		}
+	}
+	path[len] = '\0';
+
+	closedir(d);
+}
+
+/*
+ * Take directories off the queue until it is empty and no one
+ * is listing a directory that could add to it.
+ */
+static void *
+tree_worker(void *arg)
+{
+	char path[PATH_MAX];
+	size_t len;
+
+	pthread_mutex_lock(&tree_lock);
+	while (1) {
+		while (tree.ndirs <= tree_next && 0 < tree_busy)
+			pthread_cond_wait(&tree_cond, &tree_lock);
+		if (tree.ndirs <= tree_next)
+			break;
+
+		len = strlen(tree.pool + tree.dir[tree_next]);
+		memcpy(path, tree.pool + tree.dir[tree_next++], len + 1);
+		++tree_busy;
+		pthread_mutex_unlock(&tree_lock);
+
+		tree_list(path, len);
+
+		pthread_mutex_lock(&tree_lock);
+		if (--tree_busy == 0)
+			pthread_cond_broadcast(&tree_cond);
+	}
+	pthread_mutex_unlock(&tree_lock);
+
+	return NULL;
+}
+
+static int
+tree_cmp(const void *a, const void *b)
+{
+
+	return strcmp(tree.pool + *(const int *) a,
+	    tree.pool + *(const int *) b);
+}
+
+/*
+ * Threads for a walk or a search: one per processor.
+ */
+static int
+workers(void)
+{
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (ncpu < 1) ? 1 : (GREP_MAX < ncpu) ? GREP_MAX : ncpu;
+}
+
+/*
+ * Whether the tree may have changed since the last walk.
+ */
+static int
+tree_changed(void)
+{
+	struct stat st;
+	const char *p;
+	int i;
+
+	if (tree.ndirs == 0)
+		return 1;
+
+#ifdef __linux__
+	if (treewatch) {
+		struct pollfd pfd;
+
+		pfd.fd = treefd;
+		pfd.events = POLLIN;
+
+		return (poll(&pfd, 1, 0) != 0);
+	}
+#endif
+
+	for (i = 0; i < tree.ndirs; i++) {
+		p = tree.pool + tree.dir[i];
+		if (stat((*p == '\0') ? "." : p, &st) == -1 ||
+		    st.st_mtime != tree.mtime[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Walk the tree again if it has changed.  The names are sorted,
+ * so the finder and the search see them in the same order
+ * however the threads met them.
+ */
+static void
+tree_update(void)
+{
+	pthread_t tid[GREP_MAX];
+	struct stat st;
+	int i, nt;
+
+	if (!tree_changed())
+		return;
+
+	tree.used = 0;
+	tree.nfiles = tree.ndirs = 0;
+
+#ifdef __linux__
+	if (treefd != -1)
+		close(treefd);
+	treefd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	treewatch = (treefd != -1);
+#endif
+
+	if (stat(".", &st) == -1)
+		return;
+	tree_dir("", 0, st.st_mtime);
+	tree_next = tree_busy = 0;
+
+	nt = workers() - 1;
+	for (i = 0; i < nt; i++) {
+		if (pthread_create(&tid[i], NULL, tree_worker, NULL) != 0)
+			break;
+	}
+	nt = i;
+	tree_worker(NULL);
+	for (i = 0; i < nt; i++)
+		pthread_join(tid[i], NULL);
+
+	qsort(tree.name, tree.nfiles, sizeof(int), tree_cmp);
+	for (i = 0; i < tree.nfiles; i++)
+		tree.mask[i] = charmask(tree.pool + tree.name[i]);
+}
+
+/*
+ * Score q as a subsequence of s, ignoring case.  Matches that
+ * start a word or follow the last one count for more, gaps
+ * and long names for less.  INT_MIN if q does not match.
+ */
+static int
+fuzzy(const char *s, const char *q)
+{
+	const char *last = NULL, *p = s;
+	int gap, score = 0;
+
+	for (; *q != '\0'; q++, p++) {
+		while (*p != '\0' &&
+		    tolower((unsigned char) *p) != tolower((unsigned char) *q))
+			++p;
+		if (*p == '\0')
+			return INT_MIN;
+
+		if (p == s || strchr("/_-. ", p[-1]) != NULL)
+			score += 8;
+		if (last != NULL) {
+			if ((gap = p - last - 1) == 0)
+				score += 6;
+			else
+				score -= (gap < 8) ? gap : 8;
+		}
+		last = p;
+	}
+
+	if (last != NULL && strchr(last, '/') == NULL)
+		score += 4;
+
+	return score - (int) (strlen(s) / 8);
+}
+
+/*
+ * List the best matches for q under the prompt.
+ */
+static void
+find_show(const char *q)
+{
+	int best[ROW_MAX - 1], score[ROW_MAX - 1];
+	int i, j, n = 0, v;
+	unsigned long m;
+	const char *s;
+
+	m = charmask(q);
+	for (i = 0; i < tree.nfiles; i++) {
+		if ((tree.mask[i] & m) != m)
+			continue;
+		if ((v = fuzzy(tree.pool + tree.name[i], q)) == INT_MIN)
+			continue;
+		if (n == ROW_MAX - 1 && v <= score[n - 1])
+			continue;
+
+		j = (n < ROW_MAX - 1) ? n++ : n - 1;
+		for (; 0 < j && score[j - 1] < v; j--) {
+			best[j] = best[j - 1];
+			score[j] = score[j - 1];
+		}
+		best[j] = i;
+		score[j] = v;
+	}
+
+	found = (n == 0) ? -1 : best[0];
+
+	for (i = 0; i < ROW_MAX - 1; i++) {
+		memset(screen[i], ' ', COL_MAX);
+		if (i < n) {
+			s = tree.pool + tree.name[best[i]];
+			for (j = 0; j < COL_MAX && s[j] != '\0'; j++)
+				screen[i][j] = s[j];
+		}
+#ifdef ANSI
+		put_row(i + 1, screen[i], shadow[i + 1], 0);
+#endif
+	}
+}
+#endif
+
+/*
+ * Open another file.  On Unix the answer picks from the files
+ * under the current directory, best match first; a name that
+ * exists as typed is taken as is.
+ */
+static void
+open_file(void)
+{
+	char *str;
+#ifdef __unix__
+	struct stat st;
+#endif
+
+	if (dirty) {
+		message("unsaved changes");
+		return;
+	}
+
+#ifdef __unix__
+	tree_update();
+	found = -1;
+
+	if ((str = get_response(PR_OPEN, find_show)) == NULL)
+		return;
+
+	if (stat(str, &st) == -1 && found != -1)
+		str = tree.pool + tree.name[found];
+#else
+	if ((str = get_response(PR_OPEN, NULL)) == NULL)
+		return;
+#endif
+
+	load_file(str);
+}
+
+#ifdef __unix__
+/*
+ * Search in files.  Threads take files from the tree in turn and
+ * collect "name:line: text" for each matching line; the results
+ * are put together in tree order once all are done.
+ */
+static pthread_mutex_t grep_lock = PTHREAD_MUTEX_INITIALIZER;
+static int grep_next;
+static struct {
+	char *s;
+	size_t n, cap;
+} *grep_out;
+
+static void
+grep_put(int f, const char *name, int line, const char *s, int n)
+{
+	char *p;
+	size_t cap, len;
+
+	len = strlen(name) + n + 16;
+	if (grep_out[f].cap < grep_out[f].n + len) {
+		cap = (grep_out[f].cap == 0) ? 4096 : grep_out[f].cap * 2;
+		while (cap < grep_out[f].n + len)
+			cap *= 2;
+		if ((p = realloc(grep_out[f].s, cap)) == NULL)
+			return;
+		grep_out[f].s = p;
+		grep_out[f].cap = cap;
+	}
+
+	grep_out[f].n += sprintf(grep_out[f].s + grep_out[f].n,
+	    "%s:%d: %.*s\n", name, line, n, s);
+}
+
+/*
+ * Files are read a block at a time rather than mapped, so one
+ * cut short under the search cannot fault it.  Only whole lines
+ * are searched; a partial one waits for the next block.  Files
+ * with a NUL early on are taken as binary and skipped.
+ */
+static void
+grep_file(int f, char **b, size_t *cap)
+{
+	const char *bol, *e, *end, *hit, *nl, *p, *s;
+	const char *name = tree.pool + tree.name[f];
+	size_t have = 0, n;
+	ssize_t r;
+	char *q;
+	int fd, line = 1;
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		return;
+
+	while (1) {
+		if (*cap - have < GREP_BLOCK) {
+			n = (*cap == 0) ? 2 * GREP_BLOCK : *cap * 2;
+			if ((q = realloc(*b, n)) == NULL)
+				break;
+			*b = q;
+			*cap = n;
+		}
+		if ((r = read(fd, *b + have, *cap - have)) == -1)
+			break;
+
+		s = *b;
+		if (line == 1 && have == 0 &&
+		    memchr(s, '\0', (r < 4096) ? r : 4096) != NULL)
+			break;
+		e = s + have + r;
+		if (r != 0) {
+			while (s < e && e[-1] != '\n')
+				--e;
+		}
+
+		for (p = bol = s; (hit = match(p, e, 1, &end)) != NULL;
+		    p = nl + 1) {
+			for (; (nl = memchr(p, '\n', hit - p)) != NULL; p = nl + 1) {
+				++line;
+				bol = nl + 1;
+			}
+			if ((nl = memchr(hit, '\n', e - hit)) == NULL)
+				nl = e;
+			grep_put(f, name, line, bol,
+			    (nl - bol < GREP_LINE) ? nl - bol : GREP_LINE);
+			if (nl == e)
+				break;
+			++line;
+			bol = nl + 1;
+		}
+		for (; (nl = memchr(p, '\n', e - p)) != NULL; p = nl + 1)
+			++line;
+
+		if (r == 0)
+			break;
+		have = s + have + r - e;
+		memmove(*b, e, have);
+	}
+
+	close(fd);
+}
+
+static void *
+grep_worker(void *arg)
+{
+	char *b = NULL;
+	size_t cap = 0;
+	int f;
+
+	while (1) {
+		pthread_mutex_lock(&grep_lock);
+		f = grep_next++;
+		pthread_mutex_unlock(&grep_lock);
+
+		if (tree.nfiles <= f)
+			break;
+
+		grep_file(f, &b, &cap);
+	}
+	free(b);
+
+	return NULL;
+}
+
+/*
+ * Replace the buffer with every line under the current directory
+ * that holds the answer.  Enter on a result opens it.
+ */
+static void
+grep(void)
+{
+	pthread_t tid[GREP_MAX];
+	size_t n = 0;
+	char *str;
+	int f, full = 0, i, nt;
+
+	if (dirty) {
+		message("unsaved changes");
+		return;
+	}
+
+	if ((str = get_response(PR_GREP, NULL)) == NULL)
+		return;
+
+	if (pat_init(str) == -1) {
+		message("bad pattern");
+		return;
+	}
+	tree_update();
+
+	if ((grep_out = calloc(tree.nfiles + 1, sizeof(*grep_out))) == NULL) {
+		message("out of memory");
+		return;
+	}
+	grep_next = 0;
+
+	nt = workers();
+	for (i = 0; i < nt; i++) {
+		if (pthread_create(&tid[i], NULL, grep_worker, NULL) != 0)
+			break;
+	}
+	nt = i;
+	grep_worker(NULL);
+	for (i = 0; i < nt; i++)
+		pthread_join(tid[i], NULL);
+
+	for (f = 0; f < tree.nfiles; f++)
+		n += grep_out[f].n;
+
+	/*
+	 * All the results may not fit at once; the rest stop at the
+	 * first file whose own results the buffer cannot grow to take.
+	 */
+	new_buf("");
+	growbuf(n);
+	for (f = 0; f < tree.nfiles; f++) {
+		if (egap - gap < grep_out[f].n)
+			growbuf(grep_out[f].n);
+		if (egap - gap < grep_out[f].n)
+			full = 1;
+		if (!full) {
+			memcpy(gap, grep_out[f].s, grep_out[f].n);
+			gap += grep_out[f].n;
+		}
+		free(grep_out[f].s);
+	}
+	free(grep_out);
+
+	lines_build();
+	results = 1;
+
+	if (full)
+		message("results truncated");
+	else if (n == 0)
+		message("no matches");
+}
+
+/*
+ * Open the file named by the result under the cursor, at its line.
+ */
+static void
+grep_jump(void)
+{
+	char name[COL_MAX - 5];
+	struct stat st;
+	int c, at = -1, i, k, line = 0, n, offset;
+
+	offset = prevline(idx);
+	for (n = 0; n < sizeof(name) - 1; n++) {
+		if ((c = byteat(offset + n)) == '\n' || c == -1)
+			break;
+		name[n] = c;
+	}
+	name[n] = '\0';
+
+	/*
+	 * A name may hold ":12:" itself, so take the first split
+	 * whose name is a file, or failing that the first split.
+	 */
+	for (i = 0; i < n; i++) {
+		for (k = i + 1; '0' <= name[k] && name[k] <= '9'; k++)
+			;
+		if (name[i] != ':' || k == i + 1 || name[k] != ':')
+			continue;
+		if (at == -1)
+			at = i;
+		name[i] = '\0';
+		if (stat(name, &st) == 0) {
+			at = i;
+			break;
+		}
+		name[i] = ':';
+	}
+	if (at == -1)
+		return;
+
+	name[at] = '\0';
+	for (k = at + 1; name[k] != ':'; k++)
+		line = (line * 10) + (name[k] - '0');
+	if (line == 0)
+		return;
+
+	load_file(name);
+	idx = line_start(line);
+}
+#endif
+
+static int
+getn(const char *str)
+{
+	int i = 0;
+
+	while (*str >= '0' && *str <= '9')
+		i = (i * 10) + (*str++ - '0');
+
+	return i;
+}
+
+#ifdef __unix__
+/*
+ * Sizes take an optional k, m, or g suffix.
+ */
+static unsigned long
+getsize(const char *str)
+{
+	unsigned long n = 0;
+
+	if (*str < '0' || *str > '9')
+		return 0;
+
+	while (*str >= '0' && *str <= '9')
+		n = (n * 10) + (*str++ - '0');
+
+	switch (*str) {
+	case 'g':
+	case 'G':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		n <<= 10;
+		++str;
+	}
+
+	return (*str == '\0') ? n : 0;
+}
+
+/*
+ * Factors are given as 1.5, 2, etc. and kept in tenths.
+ */
+static unsigned long
+getfactor(const char *str)
+{
+	unsigned long n = 0;
+
+	while (*str >= '0' && *str <= '9')
+		n = (n * 10) + (*str++ - '0');
+	n *= 10;
+
+	if (*str == '.' && str[1] >= '0' && str[1] <= '9') {
+		n += str[1] - '0';
+		str += 2;
+	}
+
+	return (*str == '\0' && n >= 10) ? n : 0;
+}
+
+static int
+bufopt(int opt, const char *val)
+{
+	static int maxset;
+	unsigned long n;
+
+	if ((n = (opt == 'f') ? getfactor(val) : getsize(val)) == 0)
+		return -1;
+
+	switch (opt) {
+	case 'b':
+		bufsize = n;
+		break;
+	case 'f':
+		bufgrow = n;
+		break;
+	case 'g':
+		bufgap = n;
+		break;
+	case 'm':
+		bufmax = n;
+		maxset = 1;
+		break;
+	case 'z':
+		coldmax = (n < COLD_MIN * COLD_CHUNK) ?
+		    COLD_MIN * COLD_CHUNK : n;
+	}
+
+	if (bufsize > bufmax) {
+		if (maxset)
+			bufsize = bufmax;
+		else
+			bufmax = bufsize;
+	}
+
+	/*
+	 * Offsets into the buffer are ints.
+	 */
+	if (bufmax > INT_MAX)
+		bufmax = INT_MAX;
+	if (bufsize > INT_MAX)
+		bufsize = INT_MAX;
+
+	return 0;
+}
+#endif
+
+static void
+usage(void)
+{
+
+#ifdef __unix__
+#ifdef __linux__
+	fprintf(stderr, "usage: vce [-b size] [-f factor] [-g reserve] "
+	    "[-m limit] [-x] [-z limit] [file]\n");
+#else
+	fprintf(stderr, "usage: vce [-b size] [-f factor] [-g reserve] "
+	    "[-m limit] [-x] [file]\n");
+#endif
+#else
+	fprintf(stderr, "usage: vce [file]\n");
+#endif
+	exit(1);
+}
+
+static void
+goto_line(void)
+{
+	char *str;
+	int target = 0;
+
+	if ((str = get_response(PR_LINE, NULL)) != NULL)
+		target = getn(str);
+
+	idx = line_start(target);
+}
+
+/*
+ * Offsets are decimal, hex with a 0x prefix or h suffix,
+ * or a percentage of the buffer.  Returns -1 if str is none
+ * of these.  Offsets past the end are clamped as they are read.
+ */
+static int
+getoff(const char *str, int end)
+{
+	const char *s;
+	int base = 10, lim, n = 0, suffix = 0, v;
+
+	for (s = str; *s != '\0'; s++)
+		;
+
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+		base = 16;
+		str += 2;
+	} else if (s > str && (s[-1] == 'h' || s[-1] == 'H')) {
+		base = 16;
+		suffix = 1;
+	}
+
+	lim = (end < 100) ? 100 : end;
+	for (s = str; (v = hexval(*s)) != -1 && v < base; s++)
+		n = (n <= (lim - v) / base) ? n * base + v : lim;
+
+	if (s == str)
+		return -1;
+	if (suffix) {
+		++s;
+	} else if (*s == '%' && base == 10) {
+		if (n > 100)
+			n = 100;
+		n = end / 100 * n + end % 100 * n / 100;
+		++s;
+	}
+	if (*s != '\0')
+		return -1;
+
+	return (n < end) ? n : end;
+}
+
+/*
+ * Place the cursor directly and start the page at its line,
+ * found with a single backward scan.
+ */
+static void
+goto_offset(void)
+{
+	char *str;
+	int n;
+
+	if ((str = get_response(PR_OFFSET, NULL)) == NULL)
+		return;
+
+	if ((n = getoff(str, pos(ebuf))) == -1) {
+		message("bad offset");
+		return;
+	}
+	idx = n;
+	nibble = 0;
+
+	page = prevline(idx);
+	epage = idx + 1;
+}
+
+/*
+ * Find the next match after the cursor, wrapping around.  With
+ * the gap at the cursor everything after it is contiguous.  For
+ * the wrap the gap moves to the end of the cursor's line, so
+ * matches that run over the cursor are whole in front of it.
+ */
+static void
+find(void)
+{
+	const char *end, *p;
+	char *str;
+	int start;
+
+	if ((str = get_response(PR_FIND, NULL)) == NULL)
+		return;
+
+	if (pat_init(str) == -1) {
+		message("bad pattern");
+		return;
+	}
+	movegap();
+	start = idx;
+
+	if (egap < ebuf && (p = match(egap + 1, ebuf,
+	    *egap == '\n', &end)) != NULL) {
+		idx = pos(egap) + (p - egap);
+	} else {
+		idx = nextline(start);
+		movegap();
+		if ((p = match(buf, gap, 1, &end)) != NULL && p - buf <= start) {
+			idx = p - buf;
+		} else {
+			idx = start;
+			message("not found");
+		}
+	}
+
+	nibble = 0;
+}
+
+/*
+ * Leave a cursor here and go down a line.
+ */
+static void
+cursor_down(void)
+{
+	int offset = idx;
+
+	down();
+	if (idx != offset && cursor_add(offset) == -1)
+		message("too many cursors");
+}
+
+/*
+ * Put a cursor at every match, the main one at the first.
+ */
+static void
+cursor_matches(void)
+{
+	const char *end, *p;
+	char *str;
+	int n = 0;
+
+	if ((str = get_response(PR_FIND, NULL)) == NULL)
+		return;
+
+	if (pat_init(str) == -1) {
+		message("bad pattern");
+		return;
+	}
+	idx = 0;
+	movegap();
+
+	/* An empty match still moves on a byte. */
+	ncursors = 0;
+	for (p = egap; p <= ebuf; p = (p < end) ? end : p + 1) {
+		if ((p = match(p, ebuf, p == egap || p[-1] == '\n',
+		    &end)) == NULL)
 			break;
-		if (*p != '\r') {
-			if (*p == '\n') {
-				screen[i][j++] = ' ';
-			} else if (*p == '\t') {
-				k = 8 - (j & 7);
-				while (k--)
-					screen[i][j++] = ' ';
+		if (n++ == 0) {
+			idx = p - egap;
+		} else if (cursor_add(p - egap) == -1) {
+			message("too many cursors");
+			break;
+		}
+	}
+
+	if (n == 0)
+		message("not found");
+}
+
+/*
+ * Display column of offset, counting tabs as adjust() does.
+ */
+static int
+column(int offset)
+{
+	char *p;
+	int i = 0, o;
+
+	for (o = prevline(offset); o < offset; o++) {
+		p = ptr(o);
+		i += (*p == '\t') ? 8 - (i & 7) : 1;
+	}
+
+	return i;
+}
+
+/*
+ * Offset in line s[0..n) of display column c; *at gets the
+ * column actually reached, short of c if the line is.
+ */
+static int
+colat(const char *s, int n, int c, int *at)
+{
+	int i = 0, k;
+
+	for (k = 0; k < n && i < c; k++)
+		i += (s[k] == '\t') ? 8 - (i & 7) : 1;
+	*at = i;
+
+	return k;
+}
+
+/*
+ * The last cut or copied rectangle, one line per row.
+ */
+#ifdef __unix__
+static char *clip;
+static int clipcap;
+#else
+static char clip[CLIP_MAX];
+static int clipcap = CLIP_MAX;
+#endif
+static int cliplen;
+
+static int
+clip_add(const char *s, int n)
+{
+#ifdef __unix__
+	char *p;
+	int cap;
+#endif
+
+	/* clip is still NULL before the first cut. */
+	if (n == 0)
+		return 0;
+#ifdef __unix__
+	if (clipcap < cliplen + n) {
+		for (cap = clipcap ? clipcap : 1024; cap < cliplen + n; )
+			cap *= 2;
+		if ((p = realloc(clip, cap)) == NULL)
+			return -1;
+		clip = p;
+		clipcap = cap;
+	}
+#else
+	if (clipcap < cliplen + n)
+		return -1;
+#endif
+	memcpy(clip + cliplen, s, n);
+	cliplen += n;
+
+	return 0;
+}
+
+/*
+ * Rectangle commands on the columns between the region mark and
+ * the cursor: c copies, k cuts, y pastes at the cursor, f fills
+ * with an answer.  Each rewrites the lines involved in one pass.
+ */
+static void
+rect(int op)
+{
+	char *end, *fill = NULL, *line, *nl;
+	int a, ac, at, b, c1, c2, e, hi, k, lo, n, slot;
+	int first, last, open, rows, full = 0;
+
+	if (op != 'y') {
+		if ((slot = mark_get('.')) == 0) {
+			message("no region");
+			return;
+		}
+		first = mark_pos(slot);
+		last = idx;
+		c1 = column(first);
+		c2 = column(last);
+		if (last < first) {
+			k = first;
+			first = last;
+			last = k;
+		}
+		if (c2 < c1) {
+			k = c1;
+			c1 = c2;
+			c2 = k;
+		}
+		lo = prevline(first);
+		hi = nextline(last);
+		if (lo < hi && byteat(hi - 1) == '\n')
+			--hi;
+	} else {
+		if (cliplen == 0) {
+			message("no rectangle");
+			return;
+		}
+		c1 = c2 = column(idx);
+		lo = hi = prevline(idx);
+		for (rows = 0, k = 0; k < cliplen; k++)
+			rows += (clip[k] == '\n');
+		while (0 < rows-- && hi < pos(ebuf)) {
+			hi = nextline(hi);
+			if (rows == 0 && byteat(hi - 1) == '\n')
+				--hi;
+		}
+	}
+
+	if (op == 'f' && (fill = get_response(PR_FILL, NULL)) == NULL)
+		return;
+
+	if (op == 'c') {
+		idx = lo;
+		movegap();
+		cliplen = 0;
+		end = egap + (hi - lo);
+		for (line = egap; line <= end; line += e + 1) {
+			if ((nl = memchr(line, '\n', end - line)) == NULL)
+				nl = end;
+			e = nl - line;
+			a = colat(line, e, c1, &at);
+			b = a + colat(line + a, e - a, c2 - at, &at);
+			if (clip_add(line + a, b - a) == -1 ||
+			    clip_add("\n", 1) == -1) {
+				message("rectangle too big");
+				break;
+			}
+		}
+		idx = adjust(lo, c1);
+		return;
+	}
+	if (op == 'k')
+		cliplen = 0;
+	else if (op != 'f' && op != 'y')
+		return;
+
+	rw_begin(lo, hi);
+
+	for (k = 0, open = 1; ; ) {
+		if (!open && rw_write("\n", 1) == -1) {
+			full = 1;
+			break;
+		}
+
+		line = egap;
+		e = rw_hi - rw_lo - rw_in;
+		if ((nl = memchr(line, '\n', e)) != NULL)
+			e = nl - line;
+
+		a = colat(line, e, c1, &ac);
+		b = a + colat(line + a, e - a, c2 - ac, &at);
+		if (!open)
+			a = b = e = ac = 0;
+
+		if (op == 'k') {
+			if (full || clip_add(line + a, b - a) == -1 ||
+			    clip_add("\n", 1) == -1) {
+				full = 1;
+				rw_copy(e);
 			} else {
-				screen[i][j++] = *p;
+				rw_copy(a);
+				rw_skip(b - a);
+				rw_copy(e - b);
+			}
+		} else {
+			if (rw_copy(a) == -1 || (ac < c1 &&
+			    rw_fill(' ', c1 - ac) == -1)) {
+				full = 1;
+				break;
+			}
+			rw_skip(b - a);
+			if (op == 'f') {
+				n = rw_write(fill, strlen(fill));
+			} else {
+				nl = memchr(clip + k, '\n', cliplen - k);
+				n = rw_write(clip + k, nl - clip - k);
+				k = nl - clip + 1;
+			}
+			if (n == -1 || rw_copy(e - b) == -1) {
+				full = 1;
+				break;
 			}
 		}
-		if (*p == '\n' || COL_MAX <= j) {
-			++i;
-			j = 0;
+
+		if (rw_in < rw_hi - rw_lo) {
+			rw_copy(1);
+			open = 1;
+		} else {
+			open = 0;
+		}
+		if (op == 'y' ? cliplen <= k : !open)
+			break;
+	}
+
+	rw_end();
+	idx = adjust(lo, c1);
+
+	if (full)
+		message((op == 'k') ? "rectangle too big" : "buffer full");
+}
+
+/*
+ * Write the len bytes at t over the n old ones in a rewrite.  When
+ * both hold as many lines, it goes a line at a time and keeps what
+ * the two lines share at either end, so marks stay on their line
+ * and, where the text is the same, at their place in it.
+ */
+static int
+undo_put(const char *t, int len, int n)
+{
+	const char *e, *nl;
+	int a, b, i, k, lines = 0;
+
+	if (rw_room(len) == -1)
+		return -1;
+
+	for (i = 0; i < len; i++)
+		lines += (t[i] == '\n');
+	for (i = 0; i < n; i++)
+		lines -= (egap[i] == '\n');
+
+	/* t may be NULL when len is 0, so memchr() must not see it. */
+	if (lines != 0 || len == 0) {
+		rw_write(t, len);
+		rw_skip(n);
+		return 0;
+	}
+
+	for (e = t + len; t <= e; t = nl + 1) {
+		if ((nl = memchr(t, '\n', e - t)) == NULL)
+			nl = e;
+		a = nl - t;
+		for (b = 0; b < rw_hi - rw_lo - rw_in && egap[b] != '\n'; b++)
+			;
+
+		for (i = 0; i < a && i < b && t[i] == egap[i]; i++)
+			;
+		for (k = 0; k < a - i && k < b - i &&
+		    t[a - 1 - k] == egap[b - 1 - k]; k++)
+			;
+		rw_copy(i);
+		rw_skip(b - i - k);
+		rw_write(t + i, a - i - k);
+		rw_copy(k);
+
+		if (nl < e)
+			rw_copy(1);
+	}
+
+	return 0;
+}
+
+/*
+ * Put back the text of the last command's changes, newest first.
+ */
+static void
+undo(void)
+{
+	struct undo *u;
+	char *t;
+	int full, g;
+
+	if (nundo == 0) {
+		message("nothing to undo");
+		return;
+	}
+
+	g = undos[nundo - 1].group;
+	undoing = 1;
+	while (0 < nundo && undos[nundo - 1].group == g) {
+		u = &undos[--nundo];
+		ulen -= u->size ? u->size : u->len;
+		t = utext + ulen;
+#ifdef __unix__
+		if (u->size != 0) {
+			if ((t = malloc(u->len)) == NULL) {
+				undo_clear();
+				message("out of memory");
+				break;
+			}
+			undo_unpack(utext + ulen, t, u->len);
+		}
+#endif
+
+		rw_begin(u->lo, u->lo + u->n);
+		full = undo_put(t, u->len, u->n);
+		rw_end();
+
+#ifdef __unix__
+		if (u->size != 0)
+			free(t);
+#endif
+		if (full == -1) {
+			undo_clear();
+			message("buffer full");
+			break;
 		}
-		++epage;
 	}
+	undoing = 0;
+	utyping = 0;
+}
+
+/*
+ * Make the insertion on top part of the run of typing it follows,
+ * so they are undone together, and let typing carry on in it.
+ */
+static void
+undo_join(int run)
+{
+	struct undo *u;
+
+	if (run && 2 <= nundo) {
+		u = &undos[nundo - 1];
+		if (u->len == 0 && u[-1].lo + u[-1].n == u->lo) {
+			u[-1].n += u->n;
+			--nundo;
+		}
+	}
+	utyping = 1;
+}
+
+/*
+ * Start a new line indented like the one the cursor is on, up to
+ * the cursor.  The line index gives where the line starts.  The
+ * indent is scanned afresh rather than cached per line: it costs
+ * only its own length, where a cache would have to follow every
+ * edit.
+ */
+static void
+newline(void)
+{
+	char *p;
+	int k, lo, run;
 
-	update_modeline(get_linecolno());
+	run = utyping;
+	rw_begin(idx, idx);
+#ifdef __unix__
+	lo = (nleft == 0) ? 0 : lines[nleft - 1] + 1;
+#else
+	lo = prevline(idx);
+#endif
 
-#ifdef ANSI
-	write(1, "\033[2J\033[H\033[7m", 11);
-	write(1, modeline, sizeof(modeline));
-	write(1, "\033[0m", 4);
+	for (p = buf + lo; p < gap && (*p == ' ' || *p == '\t'); p++)
+		;
+	k = p - (buf + lo);
+	if (rw_room(1 + k) == -1)
+		k = 0;
+
+	rw_write("\n", 1);
+	rw_write(buf + lo, k);
+	idx = rw_lo + rw_end();
+	undo_join(run);
+}
 
-	for (i = 0; i < ROW_MAX - 1; i++) {
-		write(1, "\033[", 2);
-		write(1, putn(i + 2), strlen(putn(i + 2)));
-		write(1, ";1H", 3);
-		write(1, screen[i], sizeof(screen[i]));
+/*
+ * The lines from the region mark to the cursor, or all of them,
+ * less the last newline.
+ */
+static void
+region(int *lo, int *hi)
+{
+	int first, last, slot;
+
+	if ((slot = mark_get('.')) == 0) {
+		first = 0;
+		last = pos(ebuf);
+	} else if ((first = mark_pos(slot)) > idx) {
+		last = first;
+		first = idx;
+	} else {
+		last = idx;
 	}
 
-	write(1, "\033[", 2);
-	write(1, putn(row + 2), strlen(putn(row + 2)));
-	write(1, ";", 1);
-	write(1, putn(col + 1), strlen(putn(col + 1)));
-	write(1, "H", 1);
-#endif
+	*lo = prevline(first);
+	*hi = nextline(last);
+	if (*lo < *hi && byteat(*hi - 1) == '\n')
+		--*hi;
 }
 
-static char *
-get_response(void)
+/*
+ * Lines are sorted as slices of the old text, kept in the gap
+ * past the room for the new text, so nothing is allocated.
+ */
+struct slice {
+	const char *s;
+	int n;
+	unsigned long key;
+};
+static int sortop;
+
+static long
+leadnum(const char *s, int n, int *ok)
 {
-	int ch, i, j = 0;
-
-	for (i = 0; i < sizeof(response); i++)
-		response[i] = '\0';
-
-	for (i = 0; i < COL_MAX; i++)
-		modeline[i] = '\0';
+	long v = 0;
+	int i = 0, neg = 0;
 
-	i = strdcpy(modeline, "VCE: ");
-	while (i < COL_MAX)
-		i += strdcat(modeline, " ", 1);
+	while (i < n && (s[i] == ' ' || s[i] == '\t'))
+		++i;
+	if (i < n && s[i] == '-') {
+		neg = 1;
+		++i;
+	}
+	*ok = (i < n && s[i] >= '0' && s[i] <= '9');
+	for (; i < n && s[i] >= '0' && s[i] <= '9'; i++)
+		v = v * 10 + (s[i] - '0');
 
-#ifdef ANSI
-	write(1, "\033[H\033[7m", 7);
-	write(1, modeline, sizeof(modeline));
-	write(1, "\033[1;6H", 6);
+	return neg ? -v : v;
+}
 
-	while ((ch = fgetc(stdin)) != '\n' && ch != '\r') {
-		if (ch == '\b' || ch == '\177') {
-			if (j == 0)
-				continue;
+/*
+ * The first bytes of a line, or its number, as an integer that
+ * sorts the same way, so most comparisons stay in the array.
+ */
+static unsigned long
+slicekey(const char *s, int n)
+{
+	unsigned long k = 0;
+	long v;
+	int i, ok;
 
-			for (i = 0; i < sizeof(modeline); i++)
-				modeline[i] = '\0';
+	if (sortop == 'n') {
+		v = leadnum(s, n, &ok);
+		return ok ? (unsigned long) v ^ ~(~0UL >> 1) : 0;
+	}
 
-			i = strdcpy(modeline, "VCE: ");
-			while (i < COL_MAX)
-				i += strdcat(modeline, " ", 1);
-			write(1, "\033[H", 3);
-			write(1, modeline, sizeof(modeline));
+	for (i = 0; i < sizeof(k); i++) {
+		k <<= 8;
+		if (i < n)
+			k |= (unsigned char) ((sortop == 'i') ?
+			    tolower((unsigned char) s[i]) : s[i]);
+	}
 
-			response[--j] = '\0';
+	return k;
+}
 
-			write(1, "\033[1;6H", 6);
-			write(1, response, strlen(response));
-		} else {
-			if (j == COL_MAX - 6)
-				continue;
+static int
+slicecmp(const void *va, const void *vb)
+{
+	const struct slice *a = va, *b = vb;
+	long x, y;
+	int c, i, ox, oy;
+
+	if (a->key != b->key)
+		return (a->key < b->key) ? -1 : 1;
+
+	if (sortop == 'n') {
+		x = leadnum(a->s, a->n, &ox);
+		y = leadnum(b->s, b->n, &oy);
+		if (ox != oy)
+			return ox - oy;
+		if (x != y)
+			return (x < y) ? -1 : 1;
+	}
 
-			if (!isalnum(ch) && ch != '.' && ch != '_')
-				continue;
+	if (sortop != 'i') {
+		if ((c = memcmp(a->s, b->s, (a->n < b->n) ? a->n : b->n)) != 0)
+			return c;
+		return a->n - b->n;
+	}
 
-			for (i = 0; i < sizeof(modeline); i++)
-				modeline[i] = '\0';
+	for (i = 0; i < a->n && i < b->n; i++) {
+		c = tolower((unsigned char) a->s[i]) -
+		    tolower((unsigned char) b->s[i]);
+		if (c != 0)
+			return c;
+	}
 
-			i = strdcpy(modeline, "VCE: ");
-			while (i < COL_MAX)
-				i += strdcat(modeline, " ", 1);
-			write(1, "\033[H", 3);
-			write(1, modeline, sizeof(modeline));
+	return a->n - b->n;
+}
 
-			response[j++] = ch;
+/*
+ * Sort, uniq or reverse the lines being rewritten.
+ */
+static int
+sort_lines(int op)
+{
+	struct slice *sl, t;
+	char *e, *nl, *p;
+	int i, j, len, n;
+
+	len = rw_hi - rw_lo;
+	for (n = 1, p = egap, e = egap + len;
+	    (nl = memchr(p, '\n', e - p)) != NULL; p = nl + 1)
+		++n;
+
+	if (rw_room(len + (n + 1) * sizeof(struct slice)) == -1)
+		return -1;
+
+	sl = (struct slice *) (gap + len + sizeof(struct slice) -
+	    (unsigned long) (gap + len) % sizeof(struct slice));
+	for (i = 0, p = egap, e = egap + len; i < n; i++, p = nl + 1) {
+		if ((nl = memchr(p, '\n', e - p)) == NULL)
+			nl = e;
+		sl[i].s = p;
+		sl[i].n = nl - p;
+	}
 
-			write(1, "\033[1;6H", 6);
-			write(1, response, strlen(response));
+#ifdef __linux__
+	/*
+	 * Sorted lines are read in any order; a packed buffer keeps
+	 * the whole span unpacked until the next key rather than
+	 * thrash.
+	 */
+	coldhold = 1;
+#endif
+	if (op == 'r') {
+		for (i = 0, j = n - 1; i < j; i++, j--) {
+			t = sl[i];
+			sl[i] = sl[j];
+			sl[j] = t;
 		}
+	} else if (op == 'u') {
+		sortop = 's';
+		for (i = 0; i < n; i++)
+			sl[i].key = 0;
+		for (i = j = 1; i < n; i++) {
+			if (slicecmp(&sl[j - 1], &sl[i]) != 0)
+				sl[j++] = sl[i];
+		}
+		n = j;
+	} else {
+		sortop = op;
+		for (i = 0; i < n; i++)
+			sl[i].key = slicekey(sl[i].s, sl[i].n);
+		qsort(sl, n, sizeof(struct slice), slicecmp);
 	}
 
-	write(1, "\033[0m", 4);
-
-	write(1, "\033[", 2);
-	write(1, putn(row + 2), strlen(putn(row + 2)));
-	write(1, ";", 1);
-	write(1, putn(col + 1), strlen(putn(col + 1)));
-	write(1, "H", 1);
+	for (i = 0; i < n; i++) {
+		if (0 < i)
+			rw_write("\n", 1);
+		rw_write(sl[i].s, sl[i].n);
+	}
+	rw_skip(len);
+#ifdef __linux__
+	coldhold = 0;
 #endif
 
-	return (j == 0) ? NULL : response;
+	return 0;
 }
 
-static void
-message(const char *msg)
+/*
+ * Indent by a tab, outdent by a tab or up to eight spaces, or
+ * trim trailing blanks, on each line being rewritten.  Empty
+ * lines are not indented.
+ */
+static int
+shift_lines(int op)
+{
+	char *nl;
+	int e, k;
+
+	while (1) {
+		e = rw_hi - rw_lo - rw_in;
+		if ((nl = memchr(egap, '\n', e)) != NULL)
+			e = nl - egap;
+
+		if (op == '>') {
+			if (0 < e && rw_write("\t", 1) == -1)
+				return -1;
+			rw_copy(e);
+		} else if (op == '<') {
+			if (0 < e && egap[0] == '\t')
+				k = 1;
+			else
+				for (k = 0; k < e && k < 8 && egap[k] == ' '; k++)
+					;
+			rw_skip(k);
+			rw_copy(e - k);
+		} else {
+			for (k = e; 0 < k &&
+			    (egap[k - 1] == ' ' || egap[k - 1] == '\t'); k--)
+				;
+			rw_copy(k);
+			rw_skip(e - k);
+		}
+
+		if (rw_in == rw_hi - rw_lo)
+			return 0;
+		rw_copy(1);
+	}
+}
+
+/*
+ * Tab from column c out to column to, or one tab past c if it
+ * is there already, then write s[0..n).  Returns the column.
+ */
+static int
+a80_field(const char *s, int n, int c, int to)
 {
 	int i;
 
-	for (i = 0; i < COL_MAX; i++)
-		modeline[i] = '\0';
+	if (0 < c || 0 < to) {
+		do {
+			rw_write("\t", 1);
+			c = (c + 8) & ~7;
+		} while (c < to);
+	}
 
-	i = strdcpy(modeline, "VCE: ");
-	i += strdcat(modeline, msg, strlen(msg));
-	while (i < COL_MAX)
-		i += strdcat(modeline, " ", 1);
+	rw_write(s, n);
+	for (i = 0; i < n; i++)
+		c += (s[i] == '\t') ? 8 - (c & 7) : 1;
 
-#ifdef ANSI
-	write(1, "\033[H\033[7m", 7);
-	write(1, modeline, sizeof(modeline));
-	write(1, "\033[0m", 4);
-#endif
+	return c;
+}
 
-	while ((i = fgetc(stdin)) != '\n') {
-		if (i == '\r')
-			break;
+/*
+ * Lay out each line being rewritten as a80 source: label:,
+ * opcode, operands and ; comment, each at its column.  A ; in
+ * quotes is part of the operands.  Lines that are all comment
+ * are left alone and blank lines are emptied.
+ */
+static int
+a80_lines(void)
+{
+	static const int to[4] = { 0, A80_OP, A80_ARG, A80_COM };
+	char *nl, *s;
+	int c, e, f[8], i, j, q;
+
+	while (1) {
+		e = rw_hi - rw_lo - rw_in;
+		if ((nl = memchr(egap, '\n', e)) != NULL)
+			e = nl - egap;
+
+		if (rw_room(e + A80_COM + 3) == -1)
+			return -1;
+		s = egap;
+
+		for (i = 0; i < e && (s[i] == ' ' || s[i] == '\t'); i++)
+			;
+		if (i == e) {
+			rw_skip(e);
+		} else if (s[i] == ';') {
+			rw_copy(e);
+		} else {
+			f[0] = i;
+			while (i < e && s[i] != ' ' && s[i] != '\t' &&
+			    s[i] != ';' && s[i++] != ':')
+				;
+			if (s[i - 1] != ':')
+				i = f[0];
+			f[1] = i;
+
+			for (j = 2; j < 6; j += 2) {
+				while (i < e && (s[i] == ' ' || s[i] == '\t'))
+					i++;
+				f[j] = i;
+				for (q = 0; i < e && (q || s[i] != ';'); i++) {
+					if (j == 2 && q == 0 &&
+					    (s[i] == ' ' || s[i] == '\t'))
+						break;
+					if (s[i] == q)
+						q = 0;
+					else if (q == 0 &&
+					    (s[i] == '\'' || s[i] == '"'))
+						q = s[i];
+				}
+				f[j + 1] = i;
+			}
+			f[6] = i;
+			f[7] = e;
+
+			for (j = 0, c = 0; j < 8; j += 2) {
+				while (f[j] < f[j + 1] && (s[f[j + 1] - 1] ==
+				    ' ' || s[f[j + 1] - 1] == '\t'))
+					f[j + 1]--;
+				if (f[j] < f[j + 1])
+					c = a80_field(s + f[j], f[j + 1] - f[j],
+					    c, to[j / 2]);
+			}
+			rw_skip(e);
+		}
+
+		if (rw_in == rw_hi - rw_lo)
+			return 0;
+		rw_copy(1);
 	}
 }
 
+/*
+ * Line commands on the region: s sorts, n sorts by leading
+ * number, i sorts ignoring case, u drops repeated lines, r
+ * reverses, > indents, < outdents, w trims trailing blanks and
+ * a lays out a80 source.  Each is one rewrite of the lines, which
+ * stay selected, and is undone as one change.
+ */
 static void
-save_file(void)
+line_cmd(int op)
 {
-	char *bp;
-	int fd, i, saveidx = idx;
+	int full, hi, lo, n, slot;
 
-	if (filename[0] == '\0') {
-		if (get_response() == NULL) {
-			message("no filename");
-			return;
-		}
+	if (strchr("snuir<>wa", op) == NULL)
+		return;
+
+	region(&lo, &hi);
+	slot = mark_get('.');
+
+	rw_begin(lo, hi);
+	if (op == 'a')
+		full = a80_lines();
+	else if (strchr("<>w", op) != NULL)
+		full = shift_lines(op);
+	else
+		full = sort_lines(op);
+	n = rw_end();
+
+	if (slot != 0) {
+		mark_set('.', lo);
+		idx = lo + n;
 	}
 
-	for (i = 0; i < sizeof(filename); i++)
-		filename[i] = '\0';
+	if (full == -1)
+		message("buffer full");
+}
 
-	for (i = 0; response[i] != '\0'; i++)
-		filename[i] = response[i];
+static void
+set_mark(int name)
+{
 
-	if ((fd = open(filename, MFLAGS, 0644)) == -1) {
-		message("failed open");
+	if (!isalnum(name) && name != '.')
 		return;
-	}
 
-	idx = 0;
+	if (mark_set(name, idx) == -1)
+		message("too many marks");
+}
 
-	movegap();
+static void
+goto_mark(int name)
+{
+	int slot;
 
-#if defined(__unix__) || defined(__msdos__)
-	write(fd, egap, ebuf - egap);
-#elif defined(__cpm__)
-	bp = egap;
-	while (*bp != EOF) {
-		if (bp == ebuf)
-			break;
+	if ((slot = mark_get(name)) == 0) {
+		message("no such mark");
+		return;
+	}
 
-		if (*bp == '\0')
-			break;
+	idx = mark_pos(slot);
+}
 
-		if (*bp == '\n')
-			write(fd, "\r\n", 2);
-		else
-			write(fd, bp, 1);
+/*
+ * Location marks ('!') toggle at the cursor.
+ */
+static void
+toggle_location(void)
+{
+	int slot;
 
-		++bp;
+	slot = mark_find(idx);
+	while (slot > 0 && mark_pos(slot) == idx) {
+		if (markname[slot] == '!') {
+			mark_del(slot);
+			return;
+		}
+		--slot;
 	}
-#endif
 
-	close(fd);
+	if (mark_set('!', idx) == -1)
+		message("too many marks");
+}
 
-	idx = saveidx;
+static void
+next_location(void)
+{
+	int i, slot;
 
-	dirty = 0;
+	slot = mark_find(idx);
+	for (i = 0; i < nmarks; i++) {
+		slot = slot % nmarks + 1;
+		if (markname[slot] == '!') {
+			idx = mark_pos(slot);
+			return;
+		}
+	}
 
-	message("save ok");
+	message("no locations");
 }
 
+/*
+ * Whether the line at offset starts with an a80 label.
+ */
 static int
-getn(const char *str)
+is_label(int offset)
 {
-	int i = 0;
-
-	while (*str >= '0' && *str <= '9')
-		i = (i * 10) + (*str++ - '0');
+	int ch, end, o;
+
+	for (o = offset, end = pos(ebuf); o < end; o++) {
+		ch = byteat(o);
+		if (ch == ' ' || ch == '\t' || ch == '\n' || ch == ';')
+			return 0;
+		if (ch == ':')
+			return offset < o;
+	}
 
-	return i;
+	return 0;
 }
 
+/*
+ * Fold the lines of the region after its first, or without a
+ * region mark, the rest of the label's section the cursor is
+ * in.  Folds that overlap or touch are taken in.  On the first
+ * line of a fold, open it instead.
+ */
 static void
-goto_line(void)
+fold(void)
 {
-	char *str;
-	int i = 0, target = 0;
+	int a, b, e, end, hi, lo, slot;
 
-	if ((str = get_response()) != NULL)
-		target = getn(str);
+	end = pos(ebuf);
+	a = nextline(idx);
+	if ((slot = fold_find(a)) != 0 && mark_pos(slot) == a) {
+		fold_del(slot);
+		return;
+	}
 
-	idx = 0;
-	while (++i < target)
-		idx = adjust(nextline(idx), 0);
+	if (mark_get('.') != 0) {
+		region(&lo, &hi);
+		b = (hi < end) ? hi + 1 : hi;
+	} else {
+		for (lo = prevline(idx); 0 < lo && !is_label(lo); )
+			lo = prevline(lo - 1);
+		for (b = nextline(lo); b < end && !is_label(b); )
+			b = nextline(b);
+	}
+
+	if (b <= (a = nextline(lo))) {
+		message("nothing to fold");
+		return;
+	}
+
+	while ((slot = fold_prev(mark_find(b))) != 0) {
+		if (markname[slot] == '}') {
+			if (mark_pos(slot) < a)
+				break;
+			e = slot;
+			slot = fold_prev(slot - 1);
+		} else {
+			e = fold_next(slot + 1);
+		}
+		if (mark_pos(slot) < a)
+			a = mark_pos(slot);
+		if (b < mark_pos(e))
+			b = mark_pos(e);
+		fold_del(slot);
+	}
+
+	if (MARK_MAX - 2 < nmarks) {
+		message("too many marks");
+		return;
+	}
+	mark_set('{', a);
+	mark_set('}', b);
+	++nfolds;
+
+	if (a <= idx && idx < b)
+		idx = prevline(a - 1);
 }
 
 static void
@@ -582,7 +6018,13 @@ init_buf(void)
 	char *bp;
 
 #if defined(__unix__)
-	if ((buf = calloc(1, BUF)) == NULL) {
+#ifdef __linux__
+	if (coldmax != 0)
+		buf = cold_init();
+	else
+#endif
+	buf = calloc(1, bufsize);
+	if (buf == NULL) {
 		fprintf(stderr, "vce: unable to create buffer\n");
 		exit(1);
 	}
@@ -599,24 +6041,67 @@ init_buf(void)
 #endif
 
 	gap = buf;
+#ifdef __unix__
+	ebuf = buf + bufsize;
+#else
 	ebuf = buf + BUF;
+#endif
 	egap = ebuf;
 }
 
 int
 main(int argc, char *argv[])
 {
-	char *bp;
-	int ch, done = 0, fd, i;
+	int ch, done = 0;
 
 #ifdef __unix__
 	struct termios term_new, term_old;
 #endif
 
-	if (argc > 2) {
-		fprintf(stderr, "usage: vce [file]\n");
-		exit(1);
+#ifdef __unix__
+	char *env;
+
+	if ((env = getenv("VCE_BUF")) != NULL && bufopt('b', env) == -1)
+		usage();
+	if ((env = getenv("VCE_GROW")) != NULL && bufopt('f', env) == -1)
+		usage();
+	if ((env = getenv("VCE_GAP")) != NULL && bufopt('g', env) == -1)
+		usage();
+	if ((env = getenv("VCE_MAX")) != NULL && bufopt('m', env) == -1)
+		usage();
+#ifdef __linux__
+	if ((env = getenv("VCE_COLD")) != NULL && bufopt('z', env) == -1)
+		usage();
+#endif
+
+	while ((ch = getopt(argc, argv, "b:f:g:m:xz:")) != -1) {
+		switch (ch) {
+		case 'b':
+		case 'f':
+		case 'g':
+		case 'm':
+#ifdef __linux__
+		case 'z':
+#endif
+			if (bufopt(ch, optarg) == -1)
+				usage();
+			break;
+		case 'x':
+			hexmode = 1;
+			break;
+		default:
+			usage();
+		}
 	}
+	argc -= optind;
+	argv += optind;
+#else
+	--argc;
+	++argv;
+#endif
+
+	if (argc > 1)
+		usage();
 
 	if (COL_MAX < 16 || ROW_MAX < 2) {
 		fprintf(stderr, "vce: error: terminal too small\n");
@@ -637,48 +6122,35 @@ main(int argc, char *argv[])
 		fprintf(stderr, "vce: could not set terminal\n");
 		exit(1);
 	}
-#elif defined(__cpm__) || defined(__msdos__)
-	write(1, "\033[12h", 5);
-#endif
-
-	if (argc == 2) {
-		for (i = 0; i < strlen(argv[1]); i++)
-			filename[i] = argv[1][i];
-		filename[i] = '\0';
 
-		if ((fd = open(filename, O_RDONLY)) == -1)
-			goto out;
-
-#if defined(__unix__) || defined(__msdos__)
-		gap += read(fd, buf, BUF);
-#elif defined(__cpm__)
-		bp = buf;
-		while (read(fd, &ch, 1) > 0) {
-			if (bp == ebuf)
-				break;
+	/*
+	 * Unbuffered, so poll(2) sees every pending key.
+	 */
+	setvbuf(stdin, NULL, _IONBF, 0);
+#endif
 
-			if (ch == EOF || ch == '\0')
-				break;
+#ifdef ANSI
+#ifdef __unix__
+	if ((env = getenv("TERM")) != NULL && strncmp(env, "vt52", 4) == 0)
+		term = &vt52;
 
-			if (ch != '\r') {
-				*bp++ = ch;
-				++gap;
-			}
-		}
+	probe_sync();
+#endif
+	outs(term->init);
 #endif
 
-		if (gap < buf)
-			gap = buf;
-
-		close(fd);
-	}
+	if (argc == 1)
+		load_file(argv[0]);
+	else
+		lines_build();
 
-out:
-	idx = 0;
 	while (!done) {
+#ifdef __linux__
+		cold_trim();
+#endif
 		update_display();
 
-		ch = fgetc(stdin);
+		ch = getkey();
 		switch (ch) {
 		case '\004': /* ^D */
 			right();
@@ -687,7 +6159,7 @@ out:
 			up();
 			break;
 		case '\014': /* ^L */
-			update_display();
+			garbled = 1;
 			break;
 		case '\023': /* ^S */
 			left();
@@ -696,8 +6168,15 @@ out:
 			down();
 			break;
 		case '\033': /* ESC */
+			utyping = 0;
 			ch = fgetc(stdin);
 			switch (ch) {
+			case '#':
+				numbers = !numbers;
+				break;
+			case '/':
+				find();
+				break;
 #if defined(ANSI) && !defined(__msdos__)
 			case '[': /* Arrow keys */
 				ch = fgetc(stdin);
@@ -713,28 +6192,102 @@ out:
 					break;
 				case 'D':
 					left();
+#ifdef __unix__
+					break;
+				case '?':
+					sync_reply();
+#endif
 				}
 				break;
 #endif
+			case 'a':
+				cursor_matches();
+				break;
+			case 'b':
+				set_mark(fgetc(stdin));
+				break;
+			case 'c':
+				cursor_down();
+				break;
+			case 'e':
+				toggle_location();
+				break;
+			case 'f':
+				open_file();
+				break;
 			case 'g':
 				goto_line();
 				break;
+			case 'h':
+				toggle_hex();
+				break;
+			case 'i':
+				statmode = !statmode;
+				break;
+			case 'j':
+				goto_mark(fgetc(stdin));
+				break;
+			case 'm':
+				set_mark('.');
+				break;
+			case 'n':
+				next_location();
+				break;
+			case 'o':
+				goto_offset();
+				break;
+#ifdef __unix__
+			case 'p':
+				grep();
+				break;
+#endif
 			case 'q':
 				done = 1;
 				break;
+			case 'r':
+				rect(fgetc(stdin));
+				break;
+			case 't':
+				line_cmd(fgetc(stdin));
+				break;
 			case 's':
 				save_file();
 				break;
+			case 'u':
+				undo();
+				break;
 			case 'v':
 				message("Version 0.9");
+				break;
+			case 'x':
+				ncursors = 0;
+				break;
+			case 'z':
+				fold();
 			}
 			break;
 		default:
-			insert(ch);
+#ifdef __unix__
+			if (results && (ch == '\r' || ch == '\n')) {
+				grep_jump();
+				break;
+			}
+#endif
+			if (hexmode)
+				hex_insert(ch);
+			else if (ncursors > 0)
+				multi_insert(ch);
+			else if (ch == '\r' || ch == '\n')
+				newline();
+			else
+				insert(ch);
 		}
 	}
 
 #if defined(__unix__)
+	while (saving)
+		job_done();
+
 	if (tcsetattr(0, TCSANOW, &term_old) == -1) {
 		fprintf(stderr, "vce: could not return terminal\n");
 		exit(1);
@@ -742,10 +6295,9 @@ out:
 #endif
 
 #ifdef ANSI
-#if defined(__cpm__) || defined(__msdos__)
-	write(1, "\033[12l", 5);
-#endif
-	write(1, "\033[H\033[2J\033[H", 10);
+	clear();
+	outs(term->fini);
+	flush();
 #endif
 
 	return 0;